@@ -0,0 +1,107 @@
+/*
+ * compress_bench.cpp
+ *
+ * What compressed FETCH buys on a slow link. For each deflate level the
+ * input is cut into COMPRESS_BLOCK frames as an upload would send it, and
+ * the bench reports the ratio, the single-thread compress and decompress
+ * rates, and the rate at which the file would arrive over a link of
+ * link_mbit: compression, the wire and decompression run as a pipeline, so
+ * the slowest of the three sets the pace. "raw" is the link alone.
+ *
+ * Without a file, a synthetic access log is used.
+ *
+ * Usage: ./compress_bench [file|-] [link_mbit]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#include "fetch_compress.h"
+
+const int RUNS = 3;
+
+std::string synthetic_log(size_t bytes) {
+    static const char *const words[] = {"GET", "POST", "/index.html", "/api/v1/users", "200", "404",
+                                        "500", "Mozilla/5.0", "curl/8.4", "user=alice", "session=9f2c"};
+    std::ostringstream out;
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; out.tellp() < (std::streamoff)bytes; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        out << "2026-10-17T12:" << std::setfill('0') << std::setw(2) << i % 60 << ":" << std::setw(2)
+            << i % 59 << " host" << i % 7 << " " << words[x % 11] << " " << words[(x >> 8) % 11] << " "
+            << words[(x >> 16) % 11] << " bytes=" << (x >> 24) % 100000 << "\n";
+    }
+    return out.str().substr(0, bytes);
+}
+
+int main(int argc, char *argv[]) {
+    std::string path = argc > 1 ? argv[1] : "-";
+    double link_mbit = argc > 2 ? std::atof(argv[2]) : 100;
+    std::string data;
+    if (path == "-") {
+        data = synthetic_log(64 << 20);
+    } else {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "Cannot open " << path << "\n";
+            return 1;
+        }
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(data.data());
+    double mb = data.size() / double(1 << 20);
+    double link_mb = link_mbit / 8;
+
+    std::cout << (path == "-" ? "synthetic log" : path) << ", " << std::fixed << std::setprecision(1) << mb
+              << " MB, link " << link_mbit << " Mbit/s\n"
+              << std::left << std::setw(8) << "level" << std::right << std::setw(8) << "ratio"
+              << std::setw(12) << "comp MB/s" << std::setw(12) << "decomp MB/s" << std::setw(14)
+              << "arrives MB/s" << "\n";
+    std::cout << std::left << std::setw(8) << "raw" << std::right << std::setprecision(2) << std::setw(8) << 1.0
+              << std::setw(12) << "-" << std::setw(12) << "-" << std::setprecision(1) << std::setw(14) << link_mb
+              << "\n";
+
+    std::vector<uint8_t> out(COMPRESS_BLOCK);
+    for (int level : {1, 3, 6, 9}) {
+        std::vector<std::string> frames;
+        double comp = 0, decomp = 0;
+        for (int r = 0; r < RUNS; ++r) {
+            frames.clear();
+            auto t0 = std::chrono::steady_clock::now();
+            for (size_t off = 0; off < data.size(); off += COMPRESS_BLOCK) {
+                frames.emplace_back();
+                compress_block(raw + off, std::min(COMPRESS_BLOCK, data.size() - off), frames.back(), level);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            for (const std::string &f : frames) {
+                const uint8_t *p = reinterpret_cast<const uint8_t *>(f.data());
+                if (!decompress_block(p + COMPRESS_FRAME_HEADER, get_be32(p + 4), out.data(), get_be32(p))) {
+                    std::cerr << "level " << level << ": frame does not decompress\n";
+                    return 1;
+                }
+            }
+            auto t2 = std::chrono::steady_clock::now();
+            double c = std::chrono::duration<double>(t1 - t0).count();
+            double d = std::chrono::duration<double>(t2 - t1).count();
+            if (r == 0 || c < comp) comp = c;
+            if (r == 0 || d < decomp) decomp = d;
+        }
+        size_t wire = 0;
+        for (const std::string &f : frames) wire += f.size();
+        double ratio = data.size() / double(wire);
+        double arrives = std::min({mb / comp, link_mb * ratio, mb / decomp});
+        std::cout << std::left << std::setw(8) << level << std::right << std::setprecision(2) << std::setw(8)
+                  << ratio << std::setprecision(0) << std::setw(12) << mb / comp << std::setw(12) << mb / decomp
+                  << std::setprecision(1) << std::setw(14) << arrives << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * content_hash.h
+ *
+ * 128-bit content hash of a shared file, published with its name so the
+ * registry can index the file by content and a download fetched by hash
+ * can be checked.
+ *
+ * The data is consumed in 64-byte stripes by eight 64-bit accumulators:
+ * each lane adds the 32x32-bit product of the two halves of (data ^ key)
+ * plus its neighbour lane's raw data word, and every BLOCK_STRIPES stripes
+ * the accumulators are scrambled. The loop maps directly onto SSE2 and
+ * AVX2 (one _mm_mul_epu32 per two lanes), which is what makes it run at
+ * memory speed; the scalar version computes the same hash bit for bit and
+ * is used on other CPUs. The final stripe is zero padded and the length is
+ * mixed into both halves of the result.
+ *
+ * This guards against corruption and tells identical files apart from
+ * different ones; it is not meant to resist deliberately crafted
+ * collisions.
+ */
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+struct ContentHash {
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+
+    bool operator==(const ContentHash &o) const { return lo == o.lo && hi == o.hi; }
+    bool operator!=(const ContentHash &o) const { return !(*this == o); }
+};
+
+namespace content_hash_detail {
+
+const size_t LANES = 8;
+const size_t STRIPE = LANES * 8;
+const size_t BLOCK_STRIPES = 16;
+const uint64_t PRIME32 = 0x9E3779B1ULL;
+const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+// Keys for accumulation, scrambling and the two output halves, drawn from
+// splitmix64 at compile time.
+constexpr std::array<uint64_t, 4 * LANES> make_keys() {
+    std::array<uint64_t, 4 * LANES> k{};
+    uint64_t x = 0x243F6A8885A308D3ULL;
+    for (size_t i = 0; i < k.size(); ++i) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        k[i] = z ^ (z >> 31);
+    }
+    return k;
+}
+constexpr std::array<uint64_t, 4 * LANES> KEYS = make_keys();
+inline const uint64_t *accumulate_key() { return KEYS.data(); }
+inline const uint64_t *scramble_key() { return KEYS.data() + LANES; }
+
+inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;         // little-endian hosts only, like the SIMD paths
+}
+
+// Mixes stripes stripes starting at p into acc, scrambling after each
+// full block; done counts stripes since the last scramble.
+inline void accumulate_scalar(uint64_t *acc, const uint8_t *p, size_t stripes, size_t &done) {
+    const uint64_t *key = accumulate_key();
+    for (size_t s = 0; s < stripes; ++s, p += STRIPE) {
+        for (size_t i = 0; i < LANES; ++i) {
+            uint64_t k = load64(p + 8 * i) ^ key[i];
+            acc[i] += (k & 0xFFFFFFFFULL) * (k >> 32) + load64(p + 8 * (i ^ 1));
+        }
+        if (++done == BLOCK_STRIPES) {
+            for (size_t i = 0; i < LANES; ++i) {
+                acc[i] ^= acc[i] >> 47;
+                acc[i] ^= scramble_key()[i];
+                acc[i] *= PRIME32;
+            }
+            done = 0;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+inline void accumulate_sse2(uint64_t *acc, const uint8_t *p, size_t stripes, size_t &done) {
+    __m128i a[LANES / 2], key[LANES / 2], skey[LANES / 2];
+    const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32));
+    for (size_t v = 0; v < LANES / 2; ++v) {
+        a[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc) + v);
+        key[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(accumulate_key()) + v);
+        skey[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(scramble_key()) + v);
+    }
+    for (size_t s = 0; s < stripes; ++s, p += STRIPE) {
+        for (size_t v = 0; v < LANES / 2; ++v) {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p) + v);
+            __m128i k = _mm_xor_si128(d, key[v]);
+            __m128i prod = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[v] = _mm_add_epi64(a[v], _mm_add_epi64(prod, swapped));
+        }
+        if (++done == BLOCK_STRIPES) {
+            for (size_t v = 0; v < LANES / 2; ++v) {
+                __m128i x = _mm_xor_si128(a[v], _mm_srli_epi64(a[v], 47));
+                x = _mm_xor_si128(x, skey[v]);
+                __m128i lo = _mm_mul_epu32(x, prime);
+                __m128i hi = _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), prime), 32);
+                a[v] = _mm_add_epi64(lo, hi);
+            }
+            done = 0;
+        }
+    }
+    for (size_t v = 0; v < LANES / 2; ++v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(acc) + v, a[v]);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void accumulate_avx2(uint64_t *acc, const uint8_t *p, size_t stripes, size_t &done) {
+    __m256i a[LANES / 4], key[LANES / 4], skey[LANES / 4];
+    const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32));
+    for (size_t v = 0; v < LANES / 4; ++v) {
+        a[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc) + v);
+        key[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(accumulate_key()) + v);
+        skey[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(scramble_key()) + v);
+    }
+    for (size_t s = 0; s < stripes; ++s, p += STRIPE) {
+        for (size_t v = 0; v < LANES / 4; ++v) {
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p) + v);
+            __m256i k = _mm256_xor_si256(d, key[v]);
+            __m256i prod = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+            a[v] = _mm256_add_epi64(a[v], _mm256_add_epi64(prod, swapped));
+        }
+        if (++done == BLOCK_STRIPES) {
+            for (size_t v = 0; v < LANES / 4; ++v) {
+                __m256i x = _mm256_xor_si256(a[v], _mm256_srli_epi64(a[v], 47));
+                x = _mm256_xor_si256(x, skey[v]);
+                __m256i lo = _mm256_mul_epu32(x, prime);
+                __m256i hi = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime), 32);
+                a[v] = _mm256_add_epi64(lo, hi);
+            }
+            done = 0;
+        }
+    }
+    for (size_t v = 0; v < LANES / 4; ++v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc) + v, a[v]);
+    }
+}
+#endif
+
+using AccumulateFn = void (*)(uint64_t *, const uint8_t *, size_t, size_t &);
+
+inline AccumulateFn pick_kernel() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return accumulate_avx2;
+    return accumulate_sse2;
+#else
+    return accumulate_scalar;
+#endif
+}
+
+__extension__ typedef unsigned __int128 uint128;
+
+inline uint64_t mul_fold(uint64_t a, uint64_t b) {
+    uint128 p = static_cast<uint128>(a) * b;
+    return static_cast<uint64_t>(p) ^ static_cast<uint64_t>(p >> 64);
+}
+
+inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t merge(const uint64_t *acc, const uint64_t *key, uint64_t start) {
+    uint64_t r = start;
+    for (size_t i = 0; i < LANES; i += 2) r += mul_fold(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+    return avalanche(r);
+}
+
+} // namespace content_hash_detail
+
+// Which accumulate loop content_hash() runs on this CPU.
+inline const char *content_hash_kernel() {
+    using namespace content_hash_detail;
+#if defined(__x86_64__)
+    return pick_kernel() == accumulate_avx2 ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// simd = false forces the scalar loop, which must give the same result.
+inline ContentHash content_hash(const uint8_t *p, size_t len, bool simd = true) {
+    using namespace content_hash_detail;
+    static const AccumulateFn kernel = pick_kernel();
+    AccumulateFn run = simd ? kernel : accumulate_scalar;
+
+    uint64_t acc[LANES] = {PRIME32, PRIME64_1, PRIME64_2, 0x165667B19E3779F9ULL,
+                           0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, PRIME64_2 ^ PRIME32, PRIME64_1 >> 1};
+    size_t done = 0;
+    size_t full = len / STRIPE;
+    run(acc, p, full, done);
+
+    uint8_t last[STRIPE] = {};
+    std::memcpy(last, p + full * STRIPE, len - full * STRIPE);
+    run(acc, last, 1, done);
+
+    ContentHash h;
+    h.lo = merge(acc, KEYS.data() + 2 * LANES, len * PRIME64_1);
+    h.hi = merge(acc, KEYS.data() + 3 * LANES, ~(len * PRIME64_2));
+    return h;
+}
+
+// Hashes the file at path through a read-only mapping. False if it cannot
+// be opened or mapped.
+inline bool hash_file(const std::string &path, ContentHash &out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    size_t len = static_cast<size_t>(st.st_size);
+    if (len == 0) {
+        close(fd);
+        out = content_hash(nullptr, 0);
+        return true;
+    }
+    void *m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return false;
+    madvise(m, len, MADV_SEQUENTIAL);
+    out = content_hash(static_cast<const uint8_t *>(m), len);
+    munmap(m, len);
+    return true;
+}
+
+// The registry's index key for a hash: '#' and 32 hex digits, high half
+// first.
+inline std::string hash_key(const ContentHash &h) {
+    static const char digits[] = "0123456789abcdef";
+    std::string key(1, '#');
+    for (uint64_t half : {h.hi, h.lo}) {
+        for (int shift = 60; shift >= 0; shift -= 4) key += digits[(half >> shift) & 15];
+    }
+    return key;
+}
+
+// The 16 bytes sent in PUBLISH_HASHED, in the order hash_key() prints them.
+inline void hash_bytes(const ContentHash &h, uint8_t *out) {
+    for (int i = 0; i < 8; ++i) {
+        out[i] = static_cast<uint8_t>(h.hi >> (56 - 8 * i));
+        out[8 + i] = static_cast<uint8_t>(h.lo >> (56 - 8 * i));
+    }
+}
+
+inline bool is_hash_key(const std::string &s) {
+    if (s.size() != 33 || s[0] != '#') return false;
+    for (size_t i = 1; i < s.size(); ++i) {
+        char c = s[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * fetch_bench.cpp
+ *
+ * Loopback throughput of the FETCH receive path. A child process serves a
+ * scratch file with sendfile() the way UploadServer answers a plain FETCH
+ * (status byte, then the file until close); the parent downloads it with
+ *
+ *   stdio   the old loop: 8 KB recv() into a stack buffer, then fwrite()
+ *   buffer  receive_to_file() with splice disabled: 1 MB recv()/write()
+ *   splice  receive_to_file(): socket -> pipe -> file
+ *
+ * and reports MB/s and the parent's CPU time (user + system) per GB.
+ * Each method is run RUNS times and the fastest run is shown.
+ *
+ * Usage: ./fetch_bench [size_mb] [rcvbuf_bytes]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fetch_recv.h"
+
+const int RUNS = 3;
+const char *SRC_PATH = "/tmp/fetch_bench_src";
+const char *DST_PATH = "/tmp/fetch_bench_dst";
+
+// The receive loop as it was in fetch_file_from_peer().
+long long old_receive(int sock, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr) return -1;
+    long long total = 0;
+    uint8_t rec_buf[8192];
+    bool first_block = true;
+    while (true) {
+        ssize_t bytes_fetched = recv(sock, rec_buf, sizeof(rec_buf), 0);
+        if (bytes_fetched > 0) {
+            size_t offset = 0;
+            if (first_block && rec_buf[0] == '\0') {
+                offset = 1;
+            }
+            fwrite(rec_buf + offset, 1, bytes_fetched - offset, fp);
+            total += bytes_fetched - offset;
+            first_block = false;
+        } else if (bytes_fetched == 0) {
+            break;
+        } else {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+// Serves SRC_PATH to every connection: status 0, the file, close.
+void serve(int listen_fd) {
+    while (true) {
+        int c = accept(listen_fd, nullptr, nullptr);
+        if (c < 0) continue;
+        char req[256];
+        if (recv(c, req, sizeof(req), 0) <= 0) {
+            close(c);
+            continue;
+        }
+        int f = open(SRC_PATH, O_RDONLY);
+        off_t size = lseek(f, 0, SEEK_END);
+        off_t off = 0;
+        uint8_t status = 0;
+        send(c, &status, 1, MSG_NOSIGNAL);
+        while (off < size) {
+            if (sendfile(c, f, &off, size - off) <= 0) break;
+        }
+        close(f);
+        close(c);
+    }
+}
+
+double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+           + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+int connect_loopback(int port, int rcvbuf) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    const char req[] = "\x03" "bench.bin";
+    send(fd, req, sizeof(req), 0);
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    long long size_mb = argc > 1 ? std::atoll(argv[1]) : 256;
+    int rcvbuf = argc > 2 ? std::atoi(argv[2]) : 0;
+    long long size = size_mb << 20;
+
+    {
+        int f = open(SRC_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        std::vector<uint8_t> block(1 << 20);
+        for (size_t i = 0; i < block.size(); ++i) block[i] = static_cast<uint8_t>(i * 131 + 7);
+        for (long long m = 0; m < size_mb; ++m) {
+            if (!write_all_fd(f, block.data(), block.size())) {
+                std::perror("write");
+                return 1;
+            }
+        }
+        close(f);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0
+        || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+        std::perror("listen");
+        return 1;
+    }
+    int port = ntohs(addr.sin_port);
+    pid_t server = fork();
+    if (server == 0) {
+        serve(listen_fd);
+        _exit(0);
+    }
+    close(listen_fd);
+
+    std::cout << size_mb << " MB over loopback";
+    if (rcvbuf > 0) std::cout << ", SO_RCVBUF " << rcvbuf;
+    std::cout << "\n" << std::left << std::setw(8) << "method" << std::right
+              << std::setw(10) << "MB/s" << std::setw(14) << "CPU s/GB" << "\n";
+
+    int failed = 0;
+    for (const char *method : {"stdio", "buffer", "splice"}) {
+        double best_secs = 0, best_cpu = 0;
+        for (int r = 0; r < RUNS; ++r) {
+            int sock = connect_loopback(port, rcvbuf);
+            if (sock < 0) {
+                std::perror("connect");
+                return 1;
+            }
+            double cpu0 = cpu_seconds();
+            auto t0 = std::chrono::steady_clock::now();
+            long long got;
+            if (std::strcmp(method, "stdio") == 0) {
+                got = old_receive(sock, DST_PATH);
+            } else {
+                uint8_t status = 1;
+                recv(sock, &status, 1, MSG_WAITALL);
+                int fd = open(DST_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                got = receive_to_file(sock, fd, -1, std::strcmp(method, "splice") == 0);
+                close(fd);
+            }
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            double cpu = cpu_seconds() - cpu0;
+            close(sock);
+            if (got != size) {
+                std::cerr << method << ": received " << got << " of " << size << " bytes\n";
+                ++failed;
+                break;
+            }
+            if (r == 0 || secs < best_secs) {
+                best_secs = secs;
+                best_cpu = cpu;
+            }
+        }
+        double gb = size / double(1 << 30);
+        std::cout << std::left << std::setw(8) << method << std::right << std::fixed
+                  << std::setprecision(0) << std::setw(10) << size_mb / best_secs
+                  << std::setprecision(3) << std::setw(14) << best_cpu / gb << "\n";
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    unlink(SRC_PATH);
+    unlink(DST_PATH);
+    return failed == 0 ? 0 : 1;
+}
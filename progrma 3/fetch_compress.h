@@ -0,0 +1,302 @@
+/*
+ * fetch_compress.h
+ *
+ * Block compression for FETCH replies. The file is cut into COMPRESS_BLOCK
+ * pieces and each is sent as a frame: raw_len(4) and wire_len(4), big
+ * endian, then wire_len bytes. A block that zlib cannot shrink is sent as
+ * is, with wire_len == raw_len. The frames of a reply add up to the count
+ * in its header, so the reply is still length-framed and the connection
+ * can carry the next one.
+ *
+ * Both ends keep the zlib work off the thread that owns the socket: the
+ * sender's BlockCompressor deflates ahead on its own thread into a short
+ * queue, and receive_compressed() inflates and writes on a second thread
+ * while the calling thread keeps reading frames.
+ *
+ * Files that are compressed already are sent raw: by name (looks_compressed)
+ * and, for the rest, by trying a sample from the start (worth_compressing).
+ */
+
+#ifndef FETCH_COMPRESS_H
+#define FETCH_COMPRESS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+static const size_t COMPRESS_BLOCK = 256 * 1024;
+static const size_t COMPRESS_FRAME_HEADER = 8;
+// Frames compressed or received ahead of the stage that consumes them.
+static const size_t COMPRESS_QUEUE_FRAMES = 8;
+// Replies shorter than this are not worth a thread and a probe.
+static const uint64_t COMPRESS_MIN_BYTES = 4096;
+// A sample this long from the start of the file must shrink to this
+// fraction or the file is sent raw.
+static const size_t COMPRESS_PROBE_BYTES = 16 * 1024;
+static const double COMPRESS_MAX_RATIO = 0.9;
+// Fast deflate. On logs level 6 is only 15-25% smaller but compresses at
+// a quarter of the speed, which makes the compressor the bottleneck on
+// links much over 200 Mbit/s (see compress_bench).
+static const int COMPRESS_LEVEL = 1;
+
+// True for names whose format is compressed already: archives, images,
+// audio and video, and documents that deflate their own streams.
+inline bool looks_compressed(const std::string &name) {
+    static const char *const exts[] = {
+        "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+        "png", "jpg", "jpeg", "gif", "webp", "mp3", "mp4", "mkv", "mov", "avi",
+        "ogg", "flac", "pdf", "docx", "xlsx", "pptx", "epub",
+    };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (char &ch : ext) ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    for (const char *e : exts) {
+        if (ext == e) return true;
+    }
+    return false;
+}
+
+inline void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+inline uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// Replaces frame with the frame for len bytes at raw.
+inline void compress_block(const uint8_t *raw, size_t len, std::string &frame, int level = COMPRESS_LEVEL) {
+    uLongf wire = compressBound(len);
+    frame.resize(COMPRESS_FRAME_HEADER + wire);
+    uint8_t *out = reinterpret_cast<uint8_t *>(&frame[0]);
+    if (compress2(out + COMPRESS_FRAME_HEADER, &wire, raw, len, level) != Z_OK || wire >= len) {
+        wire = len;
+        std::memcpy(out + COMPRESS_FRAME_HEADER, raw, len);
+    }
+    put_be32(out, static_cast<uint32_t>(len));
+    put_be32(out + 4, static_cast<uint32_t>(wire));
+    frame.resize(COMPRESS_FRAME_HEADER + wire);
+}
+
+// Restores raw_len bytes from a frame's wire_len payload into out.
+inline bool decompress_block(const uint8_t *wire, size_t wire_len, uint8_t *out, size_t raw_len) {
+    if (wire_len == raw_len) {
+        std::memcpy(out, wire, raw_len);
+        return true;
+    }
+    uLongf got = raw_len;
+    return uncompress(out, &got, wire, wire_len) == Z_OK && got == raw_len;
+}
+
+// Whether a sample from the start of a file shrinks enough to bother.
+inline bool worth_compressing(const uint8_t *sample, size_t len) {
+    if (len == 0) return false;
+    std::string frame;
+    compress_block(sample, len, frame);
+    return frame.size() - COMPRESS_FRAME_HEADER <= len * COMPRESS_MAX_RATIO;
+}
+
+// Compresses count bytes of file from offset into frames on its own thread,
+// staying at most COMPRESS_QUEUE_FRAMES ahead of next(). ready is called
+// from that thread whenever next() would stop returning WAIT.
+class BlockCompressor {
+public:
+    enum State { READY, WAIT, DONE, FAILED };
+
+    BlockCompressor(int file, uint64_t offset, uint64_t count, std::function<void()> ready)
+        : fd(file), next_off(offset), left(count), on_ready(std::move(ready)) {
+        worker = std::thread(&BlockCompressor::run, this);
+    }
+    BlockCompressor(const BlockCompressor &) = delete;
+    BlockCompressor &operator=(const BlockCompressor &) = delete;
+
+    ~BlockCompressor() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // Moves the next frame into frame if one is ready.
+    State next(std::string &frame) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!frames.empty()) {
+            frame.swap(frames.front());
+            frames.pop_front();
+            cv.notify_all();
+            return READY;
+        }
+        if (failed) return FAILED;
+        return finished ? DONE : WAIT;
+    }
+
+private:
+    void run() {
+        std::vector<uint8_t> raw(COMPRESS_BLOCK);
+        std::string frame;
+        bool ok = true;
+        while (ok && left > 0) {
+            size_t want = std::min<uint64_t>(left, COMPRESS_BLOCK);
+            size_t have = 0;
+            while (have < want) {
+                ssize_t n = pread(fd, raw.data() + have, want - have, next_off + have);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;      // the file shrank under us
+                have += n;
+            }
+            ok = have == want;
+            if (!ok) break;
+            compress_block(raw.data(), want, frame);
+            next_off += want;
+            left -= want;
+
+            std::unique_lock<std::mutex> lock(mu);
+            cv.wait(lock, [this] { return stopping || frames.size() < COMPRESS_QUEUE_FRAMES; });
+            if (stopping) return;
+            bool was_empty = frames.empty();
+            frames.emplace_back();
+            frames.back().swap(frame);
+            lock.unlock();
+            if (was_empty) on_ready();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            finished = true;
+            failed = !ok;
+        }
+        on_ready();
+    }
+
+    int fd;
+    uint64_t next_off;
+    uint64_t left;
+    std::function<void()> on_ready;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::string> frames;
+    bool finished = false;
+    bool failed = false;
+    bool stopping = false;
+    std::thread worker;
+};
+
+// Reads the frames of a count-byte compressed reply from sock and stores the
+// bytes in fd from its current offset, which ends up just past them as with
+// receive_to_file(). stored(off, len) is called, from the inflating thread,
+// for each block once it is written; off is relative to where it started.
+// Returns count, or -1 if the reply was cut short or malformed.
+inline long long receive_compressed(int sock, int fd, uint64_t count,
+                                    const std::function<void(uint64_t, uint64_t)> &stored = nullptr) {
+    off_t base = lseek(fd, 0, SEEK_CUR);
+    if (base < 0) return -1;
+    if (count > 0) fallocate(fd, 0, base, count);
+
+    struct Frame {
+        uint32_t raw_len;
+        std::string wire;
+    };
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<Frame> queue;
+    bool end = false, failed = false;
+
+    std::thread inflater([&] {
+        std::vector<uint8_t> raw(COMPRESS_BLOCK);
+        uint64_t at = 0;
+        std::unique_lock<std::mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [&] { return failed || end || !queue.empty(); });
+            if (failed || queue.empty()) return;
+            Frame f = std::move(queue.front());
+            queue.pop_front();
+            cv.notify_all();
+            lock.unlock();
+
+            const uint8_t *wire = reinterpret_cast<const uint8_t *>(f.wire.data());
+            bool ok = decompress_block(wire, f.wire.size(), raw.data(), f.raw_len);
+            size_t put = 0;
+            while (ok && put < f.raw_len) {
+                ssize_t n = pwrite(fd, raw.data() + put, f.raw_len - put, base + at + put);
+                if (n < 0 && errno == EINTR) continue;
+                ok = n > 0;
+                if (ok) put += n;
+            }
+            if (ok && stored) stored(at, f.raw_len);
+            at += f.raw_len;
+
+            lock.lock();
+            if (!ok) {
+                failed = true;
+                cv.notify_all();
+                return;
+            }
+        }
+    });
+
+    auto read_all = [sock](void *buf, size_t len) {
+        uint8_t *p = static_cast<uint8_t *>(buf);
+        while (len > 0) {
+            ssize_t n = recv(sock, p, len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    };
+
+    uint64_t got = 0;
+    bool ok = true;
+    while (ok && got < count) {
+        uint8_t hdr[COMPRESS_FRAME_HEADER];
+        Frame f;
+        ok = read_all(hdr, sizeof(hdr));
+        if (!ok) break;
+        f.raw_len = get_be32(hdr);
+        uint32_t wire_len = get_be32(hdr + 4);
+        ok = f.raw_len > 0 && f.raw_len <= COMPRESS_BLOCK && wire_len <= f.raw_len && got + f.raw_len <= count;
+        if (!ok) break;
+        f.wire.resize(wire_len);
+        ok = read_all(&f.wire[0], wire_len);
+        if (!ok) break;
+        got += f.raw_len;
+
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return failed || queue.size() < COMPRESS_QUEUE_FRAMES; });
+        ok = !failed;
+        queue.push_back(std::move(f));
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!ok) failed = true;
+        end = true;
+    }
+    cv.notify_all();
+    inflater.join();
+
+    if (failed) return -1;
+    lseek(fd, base + count, SEEK_SET);
+    return count;
+}
+
+#endif
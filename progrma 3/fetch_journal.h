@@ -0,0 +1,175 @@
+/*
+ * fetch_journal.h
+ *
+ * Sidecar journal of a download in progress, "<name>.journal" next to the
+ * file: the holder's file size on the first line, then one "offset length"
+ * line per byte range that has been stored. If the connection drops (or
+ * this process dies) the journal is left behind, and the next attempt,
+ * from the same holder or another one, fetches only the ranges it does not
+ * list.
+ *
+ * A range is only appended after fdatasync() has made its bytes durable,
+ * so everything the journal lists really is on disk. To keep the syncs
+ * rare, stored ranges are queued and written out once SYNC_BYTES of them
+ * are pending, and by flush(), which the owner calls before it closes the
+ * data file.
+ *
+ * The size is all that ties a journal to the holder's file; a file that
+ * changed size starts over. A file fetched by hash key is checked against
+ * its hash once complete.
+ */
+
+#ifndef FETCH_JOURNAL_H
+#define FETCH_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+class FetchJournal {
+public:
+    // Queued ranges are made durable once this many bytes are pending.
+    static const uint64_t SYNC_BYTES = 8 << 20;
+
+    // The journal for fetching name, a file_size-byte file.
+    FetchJournal(const std::string &name, uint64_t file_size) : path(name + ".journal"), size(file_size) {}
+    FetchJournal(const FetchJournal &) = delete;
+    FetchJournal &operator=(const FetchJournal &) = delete;
+
+    ~FetchJournal() {
+        if (journal_fd >= 0) close(journal_fd);
+    }
+
+    static bool exists(const std::string &name) {
+        struct stat st;
+        return stat((name + ".journal").c_str(), &st) == 0;
+    }
+
+    // Reads what an earlier attempt stored. Returns false if there is no
+    // journal or it is for a different size; the download then starts from
+    // nothing and start() replaces the journal.
+    bool load() {
+        ranges.clear();
+        std::ifstream in(path);
+        uint64_t journaled_size = 0;
+        if (!(in >> journaled_size) || journaled_size != size) return false;
+        uint64_t off = 0, len = 0;
+        while (in >> off >> len) {
+            if (len > 0 && off + len <= size) add(off, len);
+        }
+        return true;
+    }
+
+    // Starts writing the journal; data_fd is where the ranges are stored.
+    // resumed says load() returned true, so the existing lines are kept.
+    bool start(int data_fd, bool resumed) {
+        fd = data_fd;
+        journal_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resumed ? 0 : O_TRUNC),
+                          0644);
+        if (journal_fd < 0) return false;
+        if (!resumed) {
+            ranges.clear();
+            std::string head = std::to_string(size) + "\n";
+            if (write(journal_fd, head.data(), head.size()) != (ssize_t)head.size()) return false;
+        }
+        return true;
+    }
+
+    // Bytes already stored.
+    uint64_t stored() const {
+        uint64_t n = 0;
+        for (const auto &r : ranges) n += r.second - r.first;
+        return n;
+    }
+
+    // The gaps, in order, as [begin, end) pairs.
+    std::vector<std::pair<uint64_t, uint64_t>> missing() const {
+        std::vector<std::pair<uint64_t, uint64_t>> out;
+        uint64_t at = 0;
+        for (const auto &r : ranges) {
+            if (r.first > at) out.emplace_back(at, r.first);
+            at = std::max(at, r.second);
+        }
+        if (at < size) out.emplace_back(at, size);
+        return out;
+    }
+
+    // [off, off + len) has been written to data_fd. Safe to call from
+    // several threads.
+    void record(uint64_t off, uint64_t len) {
+        if (len == 0) return;
+        std::lock_guard<std::mutex> lock(mu);
+        pending.emplace_back(off, len);
+        pending_bytes += len;
+        if (pending_bytes >= SYNC_BYTES) write_pending();
+    }
+
+    // Makes everything recorded so far durable and journaled.
+    void flush() {
+        std::lock_guard<std::mutex> lock(mu);
+        write_pending();
+    }
+
+    // The download is complete: the journal is no longer needed.
+    void finish() {
+        std::lock_guard<std::mutex> lock(mu);
+        pending.clear();
+        pending_bytes = 0;
+        if (journal_fd >= 0) close(journal_fd);
+        journal_fd = -1;
+        unlink(path.c_str());
+    }
+
+private:
+    void add(uint64_t off, uint64_t len) {
+        uint64_t begin = off, end = off + len;
+        auto it = ranges.upper_bound(begin);
+        if (it != ranges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= begin) {
+                begin = prev->first;
+                end = std::max(end, prev->second);
+                it = ranges.erase(prev);
+            }
+        }
+        while (it != ranges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        ranges.emplace(begin, end);
+    }
+
+    // Caller holds mu.
+    void write_pending() {
+        if (pending.empty() || journal_fd < 0 || fd < 0) return;
+        if (fdatasync(fd) < 0) return;      // nothing is claimed that may not be on disk
+        std::string lines;
+        for (const auto &p : pending) {
+            lines += std::to_string(p.first) + " " + std::to_string(p.second) + "\n";
+            add(p.first, p.second);
+        }
+        if (write(journal_fd, lines.data(), lines.size()) < 0) std::perror("journal");
+        pending.clear();
+        pending_bytes = 0;
+    }
+
+    std::string path;
+    int fd = -1;
+    int journal_fd = -1;
+    uint64_t size = 0;
+    std::map<uint64_t, uint64_t> ranges;    // stored, merged: begin -> end
+    std::vector<std::pair<uint64_t, uint64_t>> pending;
+    uint64_t pending_bytes = 0;
+    std::mutex mu;
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * fetch_recv.h
+ *
+ * Receive side of a peer-to-peer FETCH: moves the file bytes arriving on a
+ * socket into the destination file.
+ *
+ * The bytes are spliced socket -> pipe -> file, so they are never copied
+ * into this process. Where the file system does not take splice() the
+ * same loop falls back to recv()/write() through one large buffer that is
+ * reused across calls. When the length is known up front the file is
+ * preallocated with fallocate(), so the blocks are reserved in one go and
+ * the writes never have to extend the file.
+ */
+
+#ifndef FETCH_RECV_H
+#define FETCH_RECV_H
+
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Bytes moved per splice() and the size of the fallback buffer.
+static const size_t RECV_PIPE_BYTES = 1 << 20;
+
+// The pipe is kept for the life of the thread; a FETCH that fails halfway
+// may leave bytes in it, so it is drained before each use.
+struct SplicePipe {
+    int rd = -1;
+    int wr = -1;
+
+    SplicePipe() {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) < 0) return;
+        rd = p[0];
+        wr = p[1];
+        fcntl(wr, F_SETPIPE_SZ, static_cast<int>(RECV_PIPE_BYTES));
+    }
+    ~SplicePipe() {
+        if (rd >= 0) close(rd);
+        if (wr >= 0) close(wr);
+    }
+};
+
+inline std::vector<uint8_t> &recv_buffer() {
+    thread_local std::vector<uint8_t> buf(RECV_PIPE_BYTES);
+    return buf;
+}
+
+inline bool write_all_fd(int fd, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Copies what sock delivers into fd at its current offset: exactly
+// expected bytes, or everything up to EOF if expected is negative.
+// Returns the number of bytes stored, or -1 on an error or a short reply.
+inline long long receive_to_file(int sock, int fd, long long expected, bool allow_splice = true) {
+    if (expected > 0) {
+        off_t at = lseek(fd, 0, SEEK_CUR);
+        // Not every file system can; the writes below extend the file anyway.
+        if (at >= 0) fallocate(fd, 0, at, expected);
+    }
+
+    thread_local SplicePipe pipe;
+    bool use_splice = allow_splice && pipe.rd >= 0;
+    if (use_splice) {
+        // Leftovers from an aborted transfer.
+        uint8_t *scratch = recv_buffer().data();
+        int fl = fcntl(pipe.rd, F_GETFL);
+        fcntl(pipe.rd, F_SETFL, fl | O_NONBLOCK);
+        while (read(pipe.rd, scratch, RECV_PIPE_BYTES) > 0) {
+        }
+        fcntl(pipe.rd, F_SETFL, fl);
+    }
+
+    long long total = 0;
+    while (expected < 0 || total < expected) {
+        size_t want = RECV_PIPE_BYTES;
+        if (expected >= 0) want = std::min<long long>(want, expected - total);
+
+        if (use_splice) {
+            ssize_t n = splice(sock, nullptr, pipe.wr, nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && total == 0 && errno == EINVAL) {
+                use_splice = false;     // e.g. not a TCP socket
+                continue;
+            }
+            if (n < 0) return -1;
+            if (n == 0) break;
+
+            ssize_t left = n;
+            while (left > 0) {
+                ssize_t m = splice(pipe.rd, nullptr, fd, nullptr, left, SPLICE_F_MOVE);
+                if (m < 0 && errno == EINTR) continue;
+                if (m < 0 && errno == EINVAL) {
+                    // The file system does not take splice(); move this
+                    // batch through the buffer and stop splicing.
+                    uint8_t *buf = recv_buffer().data();
+                    while (left > 0) {
+                        ssize_t r = read(pipe.rd, buf, std::min<size_t>(left, RECV_PIPE_BYTES));
+                        if (r <= 0 || !write_all_fd(fd, buf, r)) return -1;
+                        left -= r;
+                    }
+                    use_splice = false;
+                    break;
+                }
+                if (m <= 0) return -1;
+                left -= m;
+            }
+            total += n;
+            continue;
+        }
+
+        uint8_t *buf = recv_buffer().data();
+        ssize_t n = recv(sock, buf, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        if (!write_all_fd(fd, buf, n)) return -1;
+        total += n;
+    }
+
+    if (expected >= 0 && total != expected) return -1;
+    return total;
+}
+
+#endif
@@ -1,18 +1,237 @@
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <set>
+#include <list>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <cstdint>
 #include <cstring>
 #include <cerrno>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include "fetch_recv.h"
+#include "content_hash.h"
+#include "fetch_journal.h"
+#include "fetch_compress.h"
+
 namespace fs = std::filesystem;
 
+// Batched SEARCH understood by the registry: action, count, then count
+// 100-byte NUL-padded names. The reply is count followed by one 10-byte
+// entry per name.
+static const uint8_t ACTION_SEARCH_BATCH = 5;
+static const size_t REGISTRY_NAME_LEN = 100;
+static const size_t MAX_SEARCH_BATCH = 1024;
+
+// Pattern SEARCH: action, mode (0 prefix, 1 substring), limit, 100-byte
+// pattern. The reply is count followed by count x { 100-byte name, entry }.
+static const uint8_t ACTION_SEARCH_PATTERN = 6;
+static const uint32_t PATTERN_LIMIT = 256;
+
+// Multi-holder SEARCH: action, k, 100-byte name. The reply is count (at most
+// k) followed by count entries, least recently handed out holder first.
+static const uint8_t ACTION_SEARCH_MULTI = 7;
+static const uint32_t FETCH_CANDIDATES = 4;
+
+// Incremental PUBLISH: after the first listing, only what was added to or
+// removed from SharedFiles since is sent; additions as hashed PUBLISH below,
+// removals as this, in the layout of the batched SEARCH (action, count,
+// 100-byte names). Project 4 registries only: a standalone one gets the
+// whole listing again every time (see publish_keys).
+static const uint8_t ACTION_PUBLISH_REMOVE = 9;
+// Hashed PUBLISH: action, count, count x { 100-byte name, 16-byte content
+// hash }. The registry files us under the name and under the hash key ('#'
+// and 32 hex digits), which SEARCH and FETCH then take in place of a name.
+static const uint8_t ACTION_PUBLISH_HASHED = 13;
+// Names per send() when streaming a listing.
+static const size_t PUBLISH_SEND_NAMES = 512;
+
+// A registry started with --idle-timeout drops connections that stay silent;
+// a one-byte HEARTBEAT every HEARTBEAT_INTERVAL keeps this one registered.
+static const uint8_t ACTION_HEARTBEAT = 10;
+static const std::chrono::seconds HEARTBEAT_INTERVAL(20);
+
+// --watch coalescing: a delta goes out once SharedFiles has been quiet this
+// long, or events have kept coming for WATCH_MAX_DELAY; never two within
+// WATCH_MIN_INTERVAL, and WATCH_RETRY after one that failed.
+static const std::chrono::milliseconds WATCH_QUIET(500);
+static const std::chrono::seconds WATCH_MAX_DELAY(5);
+static const std::chrono::seconds WATCH_MIN_INTERVAL(2);
+static const std::chrono::seconds WATCH_RETRY(10);
+
+// Cluster discovery: action only. The reply is count followed by count x
+// { ip(4) port(2) }, or count 0 from a standalone registry.
+static const uint8_t ACTION_CLUSTER_MAP = 11;
+// Cluster members are project 4 registries, which number JOIN 1 rather than 0.
+static const uint8_t ACTION_REGISTRY_JOIN = 1;
+
+// Bloom filter of the names a registry has indexed: action, epoch(4),
+// generation(4) of the copy we hold. The reply is kind(1) epoch(4)
+// generation(4) n(4), then the whole bitmap as n/64 big-endian words
+// (FILTER_FULL) or n x { word_index(4) word(8) } changed since our
+// generation (FILTER_DELTA). Bit positions must match project 4/bloom_filter.h.
+static const uint8_t ACTION_FETCH_FILTER = 12;
+static const uint8_t FILTER_DELTA = 0;
+static const uint8_t FILTER_FULL = 1;
+static const uint32_t BLOOM_BITS = 1u << 20;
+static const int BLOOM_HASHES = 4;
+// A name published elsewhere is reported missing for at most this long.
+static const std::chrono::seconds FILTER_MAX_AGE(2);
+
+// Ranged FETCH between peers: action, offset(8), length(8), then the
+// filename NUL-terminated as in FETCH. The reply is status(1) (0 = ok),
+// file_size(8), count(8) and count bytes of the file from offset, and the
+// connection stays open for the next range. Length 0 only asks the size;
+// FETCH_WHOLE asks for the whole file, which makes it a length-framed
+// FETCH. A missing file is status 1 with count 0 and also keeps the
+// connection open.
+static const uint8_t ACTION_FETCH_RANGE = 4;
+static const uint64_t FETCH_WHOLE = ~uint64_t(0);
+// Set in the action byte, asks for the count bytes as fetch_compress.h
+// frames. The holder answers FETCH_COMPRESSED when it does so and the usual
+// status 0 when the file is not worth it. A peer that predates the flag
+// rejects the request and the download falls back to plain FETCH.
+static const uint8_t FETCH_FLAG_COMPRESS = 0x80;
+static const uint8_t FETCH_COMPRESSED = 2;
+// Idle download connections kept per holder, and for how long.
+static const size_t POOL_IDLE_PER_HOLDER = 4;
+static const std::chrono::seconds POOL_IDLE_TIMEOUT(30);
+// Requests sent ahead of the reply being read on one pooled connection.
+static const size_t FETCH_PIPELINE_DEPTH = 8;
+static const uint64_t FETCH_CHUNK = 1 << 20;
+// A range is only split while both halves would keep at least this much.
+static const uint64_t MIN_STEAL = 64 * 1024;
+// Downloads at least this big keep a FetchJournal, so a broken transfer
+// resumes instead of starting over.
+static const uint64_t JOURNAL_MIN_BYTES = 8 << 20;
+
+// Concurrent FETCHes in --fetch-list mode unless -j says otherwise.
+static const int DEFAULT_FETCH_JOBS = 4;
+
+// SEARCH answers are reused for this long (--search-ttl, 0 turns the cache
+// off); at most this many are kept, and this many of them misses.
+static const int DEFAULT_SEARCH_TTL = 10;
+static const size_t DEFAULT_SEARCH_CACHE = 1024;
+static const size_t DEFAULT_NEGATIVE_CACHE = 128;
+
+// SO_RCVBUF for download sockets and SO_SNDBUF for upload sockets, from
+// --rcvbuf/--sndbuf; 0 leaves the kernel's autotuning alone.
+int transfer_rcvbuf = 0;
+int transfer_sndbuf = 0;
+
+// --compress: ask holders to compress whole-file downloads.
+bool fetch_compressed = false;
+
+// Held by the command loop while it runs a command, and by the --watch
+// thread while it publishes: both use the cluster and the publish state.
+std::mutex command_mu;
+
+// Held for the whole of each request/response exchange on a registry
+// socket, and while the set of sockets changes, so a heartbeat never lands
+// in the middle of either.
+std::mutex registry_mu;
+
+// Same ring as project 4/hash_ring.h; both sides must agree on the owner of
+// every name.
+uint64_t ring_hash(const std::string &s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static const int RING_VNODES = 160;
+
+// Local copy of one registry's Bloom filter. A name it does not contain is
+// certainly not indexed there, so that SEARCH needs no round trip.
+struct NameFilter {
+    bool valid = false;
+    uint32_t epoch = 0;
+    uint32_t generation = 0;
+    std::vector<uint64_t> words;
+    std::chrono::steady_clock::time_point fetched;
+
+    bool may_contain(const std::string &name) const {
+        // The registry keeps at most REGISTRY_NAME_LEN - 1 bytes of a name.
+        uint64_t h = ring_hash(name.substr(0, REGISTRY_NAME_LEN - 1));
+        uint32_t h1 = static_cast<uint32_t>(h);
+        uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+        for (int i = 0; i < BLOOM_HASHES; ++i) {
+            uint32_t b = (h1 + i * h2) & (BLOOM_BITS - 1);
+            if (!(words[b / 64] & (uint64_t(1) << (b % 64)))) return false;
+        }
+        return true;
+    }
+};
+
+// The registries this peer talks to. Without --cluster it is a cluster of
+// one whose only socket is the connection given on the command line.
+struct RegistryCluster {
+    int primary = -1;                   // where the map is fetched from
+    std::vector<std::string> addrs;     // "ip:port" as reported, or "" standalone
+    std::vector<int> socks;             // -1 until first used
+    std::vector<std::pair<uint64_t, uint32_t>> ring;
+    std::vector<NameFilter> filters;    // one per registry, like socks
+    bool joined = false;
+    uint16_t local_port = 0;            // every registry sees us on this port
+    uint32_t peer_id = 0;
+    uint8_t join_action = 0;
+    // Project 4 registries (--cluster) answer the actions past SEARCH; the
+    // standalone registry only knows JOIN, PUBLISH and SEARCH.
+    bool extended = false;
+
+    size_t owner(const std::string &name) const {
+        if (addrs.size() == 1) return 0;
+        uint64_t h = ring_hash(name);
+        auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, uint32_t(0)));
+        if (it == ring.end()) it = ring.begin();
+        return it->second;
+    }
+};
+
+struct PublishState {
+    bool announced = false;
+    std::map<std::string, std::string> names;   // published name or hash key -> owning registry
+    std::map<std::string, ContentHash> hash_of;             // shared file -> its content hash
+    std::map<std::string, std::set<std::string>> files_with; // hash key -> shared files with it
+};
+
+// Hash key -> the file in SharedFiles it was computed from at the last
+// PUBLISH, so a FETCH by hash can be served.
+std::mutex shared_hashes_mu;
+std::unordered_map<std::string, std::string> shared_hashes;
+
 struct PeerInfo {
     uint32_t id;
     std::string ip;   
@@ -20,7 +239,128 @@ struct PeerInfo {
     bool found;
 };
 
-int lookup_and_connect(const char *host, const char *service) {
+// Recent SEARCH answers, so a name resolved a moment ago is not asked for
+// again by the next SEARCH or FETCH. Entries expire after the TTL and are
+// evicted least recently used first. "Not indexed" answers live in their
+// own, smaller LRU list so a run of misses cannot push out the hits.
+class SearchCache {
+public:
+    void configure(size_t capacity, size_t max_negative, std::chrono::seconds ttl) {
+        std::lock_guard<std::mutex> lock(mu);
+        cap = capacity;
+        neg_cap = max_negative;
+        lifetime = ttl;
+        positive.clear();
+        negative.clear();
+        index.clear();
+    }
+
+    // The cached holders of name; an empty vector is a cached miss.
+    bool lookup(const std::string &name, std::vector<PeerInfo> &holders) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = index.find(name);
+        if (it == index.end()) {
+            ++misses;
+            return false;
+        }
+        std::list<Entry> &list = list_for(*it->second);
+        if (std::chrono::steady_clock::now() >= it->second->expires) {
+            list.erase(it->second);
+            index.erase(it);
+            ++misses;
+            return false;
+        }
+        list.splice(list.begin(), list, it->second);
+        holders = it->second->holders;
+        ++hits;
+        return true;
+    }
+
+    void store(const std::string &name, const std::vector<PeerInfo> &holders) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (lifetime.count() == 0) return;
+        drop(name);
+        std::list<Entry> &list = holders.empty() ? negative : positive;
+        list.push_front(Entry{name, holders, std::chrono::steady_clock::now() + lifetime});
+        index[name] = list.begin();
+        if (list.size() > (holders.empty() ? neg_cap : cap)) {
+            index.erase(list.back().name);
+            list.pop_back();
+        }
+    }
+
+    // For a name whose cached holders just failed us.
+    void evict(const std::string &name) {
+        std::lock_guard<std::mutex> lock(mu);
+        drop(name);
+    }
+
+    void report(std::ostream &out) {
+        std::lock_guard<std::mutex> lock(mu);
+        out << "Search cache: " << hits << " hits, " << misses << " misses, "
+            << positive.size() << " entries, " << negative.size() << " not indexed\n";
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        std::vector<PeerInfo> holders;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::list<Entry> &list_for(const Entry &e) { return e.holders.empty() ? negative : positive; }
+
+    void drop(const std::string &name) {
+        auto it = index.find(name);
+        if (it == index.end()) return;
+        list_for(*it->second).erase(it->second);
+        index.erase(it);
+    }
+
+    std::mutex mu;
+    size_t cap = DEFAULT_SEARCH_CACHE;
+    size_t neg_cap = DEFAULT_NEGATIVE_CACHE;
+    std::chrono::seconds lifetime{DEFAULT_SEARCH_TTL};
+    std::list<Entry> positive, negative;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+SearchCache search_cache;
+
+// SO_REUSEADDR lets the upload server bind the port of a connected registry
+// socket; SO_REUSEPORT lets further registry sockets bind it next to the
+// listener.
+bool share_local_port(int sock, int family, int port) {
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        return false;
+    }
+    if (port == 0) return true;
+    struct sockaddr_storage ss{};
+    socklen_t len;
+    if (family == AF_INET6) {
+        auto *a6 = reinterpret_cast<struct sockaddr_in6 *>(&ss);
+        a6->sin6_family = AF_INET6;
+        a6->sin6_addr = in6addr_any;
+        a6->sin6_port = htons(port);
+        len = sizeof(*a6);
+    } else {
+        auto *a4 = reinterpret_cast<struct sockaddr_in *>(&ss);
+        a4->sin_family = AF_INET;
+        a4->sin_addr.s_addr = htonl(INADDR_ANY);
+        a4->sin_port = htons(port);
+        len = sizeof(*a4);
+    }
+    return bind(sock, reinterpret_cast<struct sockaddr *>(&ss), len) == 0;
+}
+
+// local_port >= 0 marks the socket SO_REUSEADDR so the upload server can
+// listen on the same port; a non-zero local_port is bound before connecting.
+// rcvbuf, if set, is applied before connect() so the window scale matches.
+int lookup_and_connect(const char *host, const char *service, int local_port = -1, int rcvbuf = 0) {
     struct addrinfo addr{}; 
     addr.ai_family = AF_UNSPEC;
     addr.ai_socktype = SOCK_STREAM;
@@ -38,6 +378,14 @@ int lookup_and_connect(const char *host, const char *service) {
     for (struct addrinfo *rp = result; rp != nullptr; rp = rp->ai_next) {
         sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
         if (sock == -1) continue;
+        if (local_port >= 0 && !share_local_port(sock, rp->ai_family, local_port)) {
+            close(sock);
+            sock = -1;
+            continue;
+        }
+        if (rcvbuf > 0) {
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
         if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) {
             break; // success
         }
@@ -52,6 +400,11 @@ int lookup_and_connect(const char *host, const char *service) {
     return sock;
 }
 
+// Download connection to another peer.
+int connect_to_peer(const PeerInfo &peer) {
+    return lookup_and_connect(peer.ip.c_str(), std::to_string(peer.port).c_str(), -1, transfer_rcvbuf);
+}
+
 ssize_t SEND_single_call(int sock, const uint8_t *buf, size_t len) {
     ssize_t n = send(sock, buf, len, 0); 
     if (n < 0) {
@@ -65,6 +418,21 @@ ssize_t SEND_single_call(int sock, const uint8_t *buf, size_t len) {
     return n;
 }
 
+// Like SEND_single_call, for requests too large for one send().
+bool send_all(int sock, const uint8_t *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = send(sock, buf + total, len - total, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::perror("send");
+            return false;
+        }
+        total += static_cast<size_t>(n);
+    }
+    return true;
+}
+
 // ssize_t recv(int sock, uint8_t *buf, size_t len) {
 //     size_t total = 0;
 //     while (total < len) {
@@ -80,10 +448,58 @@ ssize_t SEND_single_call(int sock, const uint8_t *buf, size_t len) {
 //     return static_cast<ssize_t>(total);
 // }
 
-bool do_join(int sock, uint32_t peer_id) {
+bool recv_all(int sock, void *buf, size_t len) {
+    size_t total = 0;
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    while (total < len) {
+        ssize_t r = recv(sock, p + total, len - total, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            std::perror("recv");
+            return false;
+        }
+        if (r == 0) return false;
+        total += static_cast<size_t>(r);
+    }
+    return true;
+}
+
+// Decodes one 10-byte SEARCH answer (peer_id, ip, port in network order).
+PeerInfo parse_search_entry(const uint8_t *resp) {
+    PeerInfo ret{};
+    ret.found = false;
+
+    uint32_t net_peer_id;
+    uint32_t net_ip;
+    uint16_t net_port;
+    std::memcpy(&net_peer_id, resp + 0, 4);
+    std::memcpy(&net_ip, resp + 4, 4);
+    std::memcpy(&net_port, resp + 8, 2);
+
+    uint32_t peer_id = ntohl(net_peer_id);
+    uint16_t port = ntohs(net_port);
+    if (peer_id == 0 && net_ip == 0 && port == 0) {
+        return ret;
+    }
+
+    char ip_str[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &net_ip, ip_str, sizeof(ip_str)) == nullptr) {
+        std::perror("inet_ntop");
+        return ret;
+    }
+
+    ret.id = peer_id;
+    ret.ip = std::string(ip_str);
+    ret.port = port;
+    ret.found = true;
+    return ret;
+}
+
+bool do_join(int sock, uint32_t peer_id, uint8_t action = 0) {
+    std::lock_guard<std::mutex> lock(registry_mu);
     std::vector<uint8_t> buf;
     buf.reserve(1 + 4);
-    buf.push_back(0); // Action = 0 (JOIN)
+    buf.push_back(action); // Action = 0 (JOIN)
     uint32_t net_id = htonl(peer_id);
     uint8_t *p = reinterpret_cast<uint8_t *>(&net_id);
     buf.insert(buf.end(), p, p + 4);
@@ -92,13 +508,14 @@ bool do_join(int sock, uint32_t peer_id) {
     return (sent == static_cast<ssize_t>(buf.size()));
 }
 
-bool do_publish(int sock) {
+std::vector<std::string> list_shared_files() {
     const fs::path shared = "SharedFiles";
+    std::vector<std::string> filenames;
     if (!fs::exists(shared) || !fs::is_directory(shared)) {
         std::cout << "Warning: SharedFiles directory does not exist or is not a directory. No files to publish.\n";
+        return filenames;
     }
 
-    std::vector<std::string> filenames;
     for (const auto &entry : fs::directory_iterator(shared, fs::directory_options::skip_permission_denied)) {
         if (!entry.is_regular_file()) continue;
         std::string fname = entry.path().filename().string();
@@ -108,31 +525,242 @@ bool do_publish(int sock) {
         }
         filenames.push_back(fname);
     }
+    return filenames;
+}
 
-    uint32_t count = static_cast<uint32_t>(filenames.size());
+// Sends action, count and count 100-byte names, PUBLISH_SEND_NAMES at a time.
+template <typename It>
+bool send_name_list(int sock, uint8_t action, It first, It last, size_t count) {
+    std::lock_guard<std::mutex> lock(registry_mu);
     std::vector<uint8_t> buf;
-    buf.reserve(1200);
-    buf.push_back(1);
+    buf.reserve(1 + 4 + PUBLISH_SEND_NAMES * REGISTRY_NAME_LEN);
+    buf.push_back(action);
+    uint32_t net_count = htonl(static_cast<uint32_t>(count));
+    uint8_t *pc = reinterpret_cast<uint8_t *>(&net_count);
+    buf.insert(buf.end(), pc, pc + 4);
+
+    size_t in_buf = 0;
+    for (It it = first; it != last; ++it) {
+        size_t at = buf.size();
+        buf.resize(at + REGISTRY_NAME_LEN, 0);
+        std::memcpy(&buf[at], it->data(), std::min(it->size(), REGISTRY_NAME_LEN - 1));
+        if (++in_buf == PUBLISH_SEND_NAMES) {
+            if (!send_all(sock, buf.data(), buf.size())) return false;
+            buf.clear();
+            in_buf = 0;
+        }
+    }
+    return buf.empty() || send_all(sock, buf.data(), buf.size());
+}
 
-    uint32_t net_count = htonl(count);
+// Full listing: action, count, then NUL-terminated names, streamed in
+// pieces so there is no upper bound on the number of files.
+bool send_full_listing(int sock, const std::vector<std::string> &names) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    std::vector<uint8_t> buf;
+    buf.push_back(1);
+    uint32_t net_count = htonl(static_cast<uint32_t>(names.size()));
     uint8_t *pc = reinterpret_cast<uint8_t *>(&net_count);
     buf.insert(buf.end(), pc, pc + 4);
 
-    for (const auto &f : filenames) {
+    for (const auto &f : names) {
         buf.insert(buf.end(), f.begin(), f.end());
         buf.push_back('\0');
+        if (buf.size() >= PUBLISH_SEND_NAMES * REGISTRY_NAME_LEN) {
+            if (!send_all(sock, buf.data(), buf.size())) return false;
+            buf.clear();
+        }
     }
+    return buf.empty() || send_all(sock, buf.data(), buf.size());
+}
 
-    if (buf.size() > 1200) {
-        std::cerr << "Error: PUBLISH request would exceed 1200 bytes (" << buf.size() << "). Aborting.\n";
+bool fetch_cluster_map(int sock, std::vector<std::string> &addrs) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    addrs.clear();
+    ssize_t sent = SEND_single_call(sock, &ACTION_CLUSTER_MAP, 1);
+    if (sent != 1) {
         return false;
     }
 
-    ssize_t sent = SEND_single_call(sock, buf.data(), buf.size());
-    return (sent == static_cast<ssize_t>(buf.size()));
+    uint32_t count;
+    if (!recv_all(sock, &count, 4)) {
+        std::cerr << "Connection closed by registry while waiting for the cluster map.\n";
+        return false;
+    }
+    count = ntohl(count);
+    std::vector<uint8_t> entries(count * 6);
+    if (!recv_all(sock, entries.data(), entries.size())) {
+        std::cerr << "Incomplete cluster map.\n";
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        char ip_str[INET_ADDRSTRLEN];
+        uint16_t port;
+        inet_ntop(AF_INET, &entries[i * 6], ip_str, sizeof(ip_str));
+        std::memcpy(&port, &entries[i * 6 + 4], 2);
+        addrs.push_back(std::string(ip_str) + ":" + std::to_string(ntohs(port)));
+    }
+    return true;
+}
+
+// Installs a new member list, keeping the connections to registries that
+// are still in it and closing the rest. An empty list means standalone.
+void apply_cluster_map(RegistryCluster &cluster, std::vector<std::string> addrs) {
+    std::vector<int> socks;
+    std::vector<NameFilter> filters;
+    if (addrs.empty()) {
+        addrs.push_back("");
+        socks.push_back(cluster.primary);
+        filters.emplace_back();
+    } else {
+        // The connection we came in on already serves its own entry; a second
+        // one from the same shared local port could not be opened.
+        std::string primary_addr;
+        struct sockaddr_in peer{};
+        socklen_t len = sizeof(peer);
+        char ip_str[INET_ADDRSTRLEN];
+        if (getpeername(cluster.primary, reinterpret_cast<struct sockaddr *>(&peer), &len) == 0
+            && peer.sin_family == AF_INET && inet_ntop(AF_INET, &peer.sin_addr, ip_str, sizeof(ip_str))) {
+            primary_addr = std::string(ip_str) + ":" + std::to_string(ntohs(peer.sin_port));
+        }
+        for (const auto &a : addrs) {
+            auto old = std::find(cluster.addrs.begin(), cluster.addrs.end(), a);
+            if (old == cluster.addrs.end() && a == primary_addr) {
+                socks.push_back(cluster.primary);
+                filters.emplace_back();
+                continue;
+            }
+            socks.push_back(old == cluster.addrs.end() ? -1 : cluster.socks[old - cluster.addrs.begin()]);
+            filters.push_back(old == cluster.addrs.end() ? NameFilter()
+                                                          : std::move(cluster.filters[old - cluster.addrs.begin()]));
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint32_t>> ring;
+    for (uint32_t n = 0; n < addrs.size(); ++n) {
+        for (int v = 0; v < RING_VNODES; ++v) {
+            ring.emplace_back(ring_hash(addrs[n] + "#" + std::to_string(v)), n);
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+
+    std::lock_guard<std::mutex> lock(registry_mu);
+    for (size_t i = 0; i < cluster.socks.size(); ++i) {
+        int fd = cluster.socks[i];
+        if (fd >= 0 && fd != cluster.primary && std::find(socks.begin(), socks.end(), fd) == socks.end()) {
+            close(fd);
+        }
+    }
+    cluster.addrs.swap(addrs);
+    cluster.socks.swap(socks);
+    cluster.ring.swap(ring);
+    cluster.filters.swap(filters);
+}
+
+// Connection to registry node, opened (and JOINed, if we have) on first use.
+int node_sock(RegistryCluster &cluster, size_t node) {
+    if (cluster.socks[node] >= 0) return cluster.socks[node];
+
+    const std::string &addr = cluster.addrs[node];
+    size_t colon = addr.rfind(':');
+    int fd = lookup_and_connect(addr.substr(0, colon).c_str(), addr.substr(colon + 1).c_str(),
+                                cluster.local_port);
+    if (fd < 0) {
+        std::cerr << "Failed to connect to registry " << addr << "\n";
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(registry_mu);
+        cluster.socks[node] = fd;
+    }
+    if (cluster.joined) {
+        do_join(fd, cluster.peer_id, cluster.join_action);
+    }
+    return fd;
+}
+
+int sock_for(RegistryCluster &cluster, const std::string &name) {
+    return node_sock(cluster, cluster.owner(name));
+}
+
+// Brings filter up to date: only the changed words if the registry still
+// has them, the whole bitmap the first time or after it restarted.
+bool fetch_filter(int sock, NameFilter &filter) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    uint8_t req[9];
+    req[0] = ACTION_FETCH_FILTER;
+    uint32_t epoch_net = htonl(filter.valid ? filter.epoch : 0);
+    uint32_t gen_net = htonl(filter.valid ? filter.generation : 0);
+    std::memcpy(req + 1, &epoch_net, 4);
+    std::memcpy(req + 5, &gen_net, 4);
+    if (!send_all(sock, req, sizeof(req))) {
+        return false;
+    }
+
+    uint8_t hdr[13];
+    if (!recv_all(sock, hdr, sizeof(hdr))) {
+        std::cerr << "Connection closed by registry while waiting for the filter.\n";
+        return false;
+    }
+    uint32_t epoch, gen, n;
+    std::memcpy(&epoch, hdr + 1, 4);
+    std::memcpy(&gen, hdr + 5, 4);
+    std::memcpy(&n, hdr + 9, 4);
+    epoch = ntohl(epoch);
+    gen = ntohl(gen);
+    n = ntohl(n);
+
+    if (hdr[0] == FILTER_FULL) {
+        if (n != BLOOM_BITS) {
+            std::cerr << "Registry filter has " << n << " bits, expected " << BLOOM_BITS << ".\n";
+            filter.valid = false;
+            return false;
+        }
+        filter.words.assign(BLOOM_BITS / 64, 0);
+        if (!recv_all(sock, filter.words.data(), BLOOM_BITS / 8)) {
+            filter.valid = false;
+            return false;
+        }
+        for (uint64_t &w : filter.words) w = be64toh(w);
+    } else {
+        std::vector<uint8_t> changed((size_t)n * 12);
+        if (!recv_all(sock, changed.data(), changed.size()) || !filter.valid) {
+            filter.valid = false;
+            return false;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t w;
+            uint64_t bits;
+            std::memcpy(&w, &changed[i * 12], 4);
+            std::memcpy(&bits, &changed[i * 12 + 4], 8);
+            w = ntohl(w);
+            if (w < filter.words.size()) filter.words[w] = be64toh(bits);
+        }
+    }
+    filter.valid = true;
+    filter.epoch = epoch;
+    filter.generation = gen;
+    filter.fetched = std::chrono::steady_clock::now();
+    return true;
+}
+
+// True if the owning registry's filter rules the name out. Refreshes the
+// filter first when it is older than FILTER_MAX_AGE; if that fails the name
+// is simply looked up as usual. A standalone registry has no filter to ask
+// for, so every name may be there.
+bool definitely_absent(RegistryCluster &cluster, const std::string &name) {
+    if (!cluster.extended) return false;
+    size_t node = cluster.owner(name);
+    NameFilter &filter = cluster.filters[node];
+    if (!filter.valid || std::chrono::steady_clock::now() - filter.fetched >= FILTER_MAX_AGE) {
+        int fd = node_sock(cluster, node);
+        if (fd < 0 || !fetch_filter(fd, filter)) return false;
+    }
+    return !filter.may_contain(name);
 }
 
 PeerInfo search_file(int sock, const std::string &filename) {
+    std::lock_guard<std::mutex> lock(registry_mu);
     PeerInfo ret{};
     ret.found = false;
 
@@ -195,125 +823,2018 @@ PeerInfo search_file(int sock, const std::string &filename) {
     return ret;
 }
 
-int fetch_file_from_peer(const PeerInfo &peer, const std::string &filename) {
-    int ip = inet_addr(peer.ip.c_str());
-    int port = peer.port;
-    int peer_sock = lookup_and_connect(peer.ip.c_str(), std::to_string(port).c_str());
+// Resolves many names with one SEARCH_BATCH round trip per MAX_SEARCH_BATCH
+// names instead of one round trip each. Results are in the order of names.
+bool search_many(int sock, const std::vector<std::string> &names, std::vector<PeerInfo> &results) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    results.clear();
+    for (size_t start = 0; start < names.size(); start += MAX_SEARCH_BATCH) {
+        size_t n = std::min(MAX_SEARCH_BATCH, names.size() - start);
 
+        std::vector<uint8_t> buf(1 + 4 + n * REGISTRY_NAME_LEN, 0);
+        buf[0] = ACTION_SEARCH_BATCH;
+        uint32_t net_count = htonl(static_cast<uint32_t>(n));
+        std::memcpy(&buf[1], &net_count, 4);
+        for (size_t k = 0; k < n; ++k) {
+            const std::string &f = names[start + k];
+            std::memcpy(&buf[5 + k * REGISTRY_NAME_LEN], f.data(), std::min(f.size(), REGISTRY_NAME_LEN - 1));
+        }
 
-    std::vector<uint8_t> buf;
-    buf.reserve(1 + filename.size() + 1);
-    buf.push_back(3);
-    buf.insert(buf.end(), filename.begin(), filename.end());
-    buf.push_back('\0');
+        ssize_t sent = SEND_single_call(sock, buf.data(), buf.size());
+        if (sent != static_cast<ssize_t>(buf.size())) {
+            return false;
+        }
 
-    ssize_t snt = SEND_single_call(peer_sock, buf.data(), buf.size());
-    if (snt < 0) {
-        std::cerr << "no" << std::endl;
-        return -1;
-    }
-    FILE *fp = fopen(filename.c_str(), "wb");
-
-    uint8_t rec_buf[8192];
-bool first_block = true;
-while (true) {
-    ssize_t bytes_fetched = recv(peer_sock, rec_buf, sizeof(rec_buf), 0);
-    if (bytes_fetched > 0) {
-        size_t offset = 0;
-        if (first_block && rec_buf[0] == '\0') {
-            offset = 1;
-        }
-        fwrite(rec_buf + offset, 1, bytes_fetched - offset, fp);
-        first_block = false;
-    } else if (bytes_fetched == 0) {
-        break;
-    } else {
-        std::cerr << "Error receiving file data from peer.\n";
-        fclose(fp);
-        close(peer_sock);
-        return -1;
+        uint32_t reply_count;
+        if (!recv_all(sock, &reply_count, 4)) {
+            std::cerr << "Connection closed by registry while waiting for SEARCH-MANY response.\n";
+            return false;
+        }
+        reply_count = ntohl(reply_count);
+        if (reply_count != n) {
+            std::cerr << "Registry answered " << reply_count << " of " << n << " names.\n";
+            return false;
+        }
+
+        std::vector<uint8_t> entries(n * 10);
+        if (!recv_all(sock, entries.data(), entries.size())) {
+            std::cerr << "Incomplete SEARCH-MANY response.\n";
+            return false;
+        }
+        for (size_t k = 0; k < n; ++k) {
+            results.push_back(parse_search_entry(&entries[k * 10]));
+        }
     }
+    return true;
 }
 
-    fclose(fp);
-    close(peer_sock);
-    return 0;
-    printf("yes\n");
-}
+// Content hashes of shared files by (device, inode, mtime, size), so a
+// republish only reads the files that changed since the last one.
+class HashCache {
+public:
+    // Hashes SharedFiles/names[k] into hashes[k], on up to one thread per
+    // core; ok[k] is false for a file that could not be read. With prune,
+    // names is everything shared and the rest of the cache is dropped.
+    void hash_all(const std::vector<std::string> &names, std::vector<ContentHash> &hashes,
+                  std::vector<bool> &ok, bool prune = true) {
+        hashes.assign(names.size(), ContentHash());
+        ok.assign(names.size(), false);
+        std::vector<Key> keys(names.size());
+        std::vector<size_t> todo;
+        for (size_t k = 0; k < names.size(); ++k) {
+            struct stat st;
+            if (stat(("SharedFiles/" + names[k]).c_str(), &st) < 0) continue;
+            keys[k] = Key(st.st_dev, st.st_ino,
+                          int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, st.st_size);
+            auto found = known.find(keys[k]);
+            if (found != known.end()) {
+                hashes[k] = found->second;
+                ok[k] = true;
+            } else {
+                todo.push_back(k);
+            }
+        }
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <registryHost> <registryPort> <peerID>\n";
-        return 1;
+        auto start = std::chrono::steady_clock::now();
+        std::atomic<size_t> next{0};
+        std::atomic<uint64_t> bytes{0};
+        auto work = [&]() {
+            size_t i;
+            while ((i = next++) < todo.size()) {
+                size_t k = todo[i];
+                if (hash_file("SharedFiles/" + names[k], hashes[k])) {
+                    ok[k] = true;
+                    bytes += std::get<3>(keys[k]);
+                }
+            }
+        };
+        size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), todo.size());
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) workers.emplace_back(work);
+        for (auto &w : workers) w.join();
+
+        // Keep only what is still shared.
+        std::map<Key, ContentHash> fresh;
+        for (size_t k = 0; k < names.size(); ++k) {
+            if (ok[k]) fresh.emplace(keys[k], hashes[k]);
+        }
+        if (prune) {
+            known.swap(fresh);
+        } else {
+            known.insert(fresh.begin(), fresh.end());
+        }
+
+        if (!todo.empty()) {
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Hashed " << todo.size() << " of " << names.size() << " files ("
+                      << bytes / (1 << 20) << " MB) in " << secs << " s on " << threads
+                      << " threads, " << content_hash_kernel() << "\n";
+        }
     }
 
-    const char *host = argv[1];
-    const char *port = argv[2];
-    char *endp = nullptr;
-    unsigned long long id_ll = strtoull(argv[3], &endp, 10);
-    if (endp == argv[3] || *endp != '\0' || id_ll == 0 || id_ll > 0xFFFFFFFFULL) {
-        std::cerr << "Error: peerID must be a positive integer < 2^32.\n";
-        return 1;
+    size_t size() const { return known.size(); }
+
+    // Drops the entries whose hash keep() rejects.
+    template <typename Keep>
+    void retain(Keep keep) {
+        for (auto it = known.begin(); it != known.end();) {
+            it = keep(it->second) ? std::next(it) : known.erase(it);
+        }
     }
-    uint32_t peer_id = static_cast<uint32_t>(id_ll);
 
-    int sock = lookup_and_connect(host, port);
-    if (sock < 0) {
-        std::cerr << "Failed to connect to registry " << host << ":" << port << "\n";
-        return 1;
+private:
+    typedef std::tuple<dev_t, ino_t, int64_t, off_t> Key;
+    std::map<Key, ContentHash> known;
+};
+
+HashCache hash_cache;
+
+// action, count, then a 100-byte name and 16-byte hash per record.
+bool send_hashed_list(int sock, const std::vector<std::pair<std::string, ContentHash>> &records) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    const size_t rec_len = REGISTRY_NAME_LEN + 16;
+    std::vector<uint8_t> buf;
+    buf.reserve(1 + 4 + PUBLISH_SEND_NAMES * rec_len);
+    buf.push_back(ACTION_PUBLISH_HASHED);
+    uint32_t net_count = htonl(static_cast<uint32_t>(records.size()));
+    uint8_t *pc = reinterpret_cast<uint8_t *>(&net_count);
+    buf.insert(buf.end(), pc, pc + 4);
+
+    size_t in_buf = 0;
+    for (const auto &r : records) {
+        size_t at = buf.size();
+        buf.resize(at + rec_len, 0);
+        std::memcpy(&buf[at], r.first.data(), std::min(r.first.size(), REGISTRY_NAME_LEN - 1));
+        hash_bytes(r.second, &buf[at + REGISTRY_NAME_LEN]);
+        if (++in_buf == PUBLISH_SEND_NAMES) {
+            if (!send_all(sock, buf.data(), buf.size())) return false;
+            buf.clear();
+            in_buf = 0;
+        }
     }
+    return buf.empty() || send_all(sock, buf.data(), buf.size());
+}
 
-    std::string cmd;
-    while (true) {
-        std::cout << "Enter a command: ";
-        if (!std::getline(std::cin, cmd)) {
-            break;
+// Records that SharedFiles/name now has content h, or is gone if h is null,
+// and adds to affected each name and hash key whose publication this may
+// change. Also updates which file a FETCH by hash key is served from.
+void set_shared(PublishState &state, const std::string &name, const ContentHash *h,
+                std::set<std::string> &affected) {
+    auto old = state.hash_of.find(name);
+    if (old != state.hash_of.end()) {
+        if (h != nullptr && old->second == *h) return;
+        std::string old_key = hash_key(old->second);
+        std::set<std::string> &files = state.files_with[old_key];
+        files.erase(name);
+        std::lock_guard<std::mutex> lock(shared_hashes_mu);
+        if (files.empty()) {
+            state.files_with.erase(old_key);
+            shared_hashes.erase(old_key);
+        } else {
+            shared_hashes[old_key] = *files.begin();
         }
+        affected.insert(old_key);
+        state.hash_of.erase(old);
+    }
+    affected.insert(name);
+    if (h == nullptr) return;
+    std::string key = hash_key(*h);
+    state.hash_of.emplace(name, *h);
+    std::set<std::string> &files = state.files_with[key];
+    files.insert(name);
+    std::lock_guard<std::mutex> lock(shared_hashes_mu);
+    shared_hashes[key] = *files.begin();
+    affected.insert(key);
+}
 
-        std::string up = cmd;
-        for (char &c : up) c = static_cast<char>(toupper((unsigned char)c));
+// Every key that is or was published, for when owners may have moved.
+void all_keys(const PublishState &state, std::set<std::string> &keys) {
+    for (const auto &f : state.hash_of) keys.insert(f.first);
+    for (const auto &k : state.files_with) keys.insert(k.first);
+    for (const auto &n : state.names) keys.insert(n.first);
+}
 
-        if (up == "JOIN") {
-            if (do_join(sock, peer_id)) {
-            } else {
-                std::cerr << "Failed to send JOIN request.\n";
-            }
+// PUBLISH has no reply, but SEARCH does and the registry answers in order:
+// once the answer to a SEARCH for key is back, whatever was sent before it
+// on fd has been handled. A key just added must then be found, unless we
+// have not JOINed and so are nobody's holder yet.
+bool confirm_published(const RegistryCluster &cluster, int fd, const std::string &key, bool added) {
+    PeerInfo pi;
+    if (cluster.extended) {
+        std::vector<PeerInfo> one;
+        if (!search_many(fd, {key}, one)) return false;
+        pi = one[0];
+    } else {
+        pi = search_file(fd, key);
+    }
+    return !added || !cluster.joined || pi.found;
+}
 
-        } else if (up == "PUBLISH") {
-            if (!do_publish(sock)) {
-                std::cerr << "PUBLISH failed.\n";
-            } else {
+// Brings the registries in line with state.hash_of for the names and hash
+// keys in affected: each goes to the registry that owns it, and is removed
+// from the one that had it if it is no longer shared or its owner changed
+// because registries joined or left the cluster. Cluster members get new
+// names as hashed records and removals as PUBLISH_REMOVE. A standalone
+// registry knows neither, so any change sends it the whole listing again
+// as a plain PUBLISH. Success is only reported once every registry written
+// to has answered a SEARCH after it (see confirm_published).
+//
+// Files with the same content share one hash key; it is only removed once
+// none of them is left.
+bool publish_keys(RegistryCluster &cluster, bool clustered, PublishState &state,
+                  const std::set<std::string> &affected) {
+    std::map<std::string, std::string> owners;      // keys going to a new owner
+    std::vector<std::string> gone;
+    std::map<std::string, std::vector<std::string>> added, removed;
+    for (const auto &key : affected) {
+        bool shared = is_hash_key(key) ? state.files_with.count(key) != 0 : state.hash_of.count(key) != 0;
+        auto old = state.names.find(key);
+        if (!shared) {
+            if (old == state.names.end()) continue;
+            removed[old->second].push_back(key);
+            gone.push_back(key);
+            continue;
+        }
+        const std::string &owner = cluster.addrs[cluster.owner(key)];
+        if (old != state.names.end() && old->second == owner) continue;
+        if (old != state.names.end()) removed[old->second].push_back(key);
+        added[owner].push_back(key);
+        owners[key] = owner;
+    }
+
+    size_t n_added = 0, n_removed = 0;
+    // Registry socket -> a key to SEARCH for once everything is sent, and
+    // whether that key was added.
+    std::map<int, std::pair<std::string, bool>> probes;
+    if (!clustered) {
+        // Not a delta: the registry has no way to take one, so it gets the
+        // whole listing again. It never sees hash keys, so only names are
+        // counted, and new content under an old name is not worth a send.
+        auto names_in = [](const std::vector<std::string> &keys) {
+            return std::count_if(keys.begin(), keys.end(), [](const std::string &k) { return !is_hash_key(k); });
+        };
+        for (const auto &a : added) n_added += names_in(a.second);
+        for (const auto &r : removed) n_removed += names_in(r.second);
+        if (!state.announced || n_added + n_removed > 0) {
+            std::vector<std::string> names;
+            for (const auto &f : state.hash_of) names.push_back(f.first);
+            int fd = node_sock(cluster, 0);
+            if (fd < 0 || !send_full_listing(fd, names)) return false;
+            if (!names.empty()) probes[fd] = std::make_pair(names.front(), true);
+        }
+    } else {
+        for (const auto &r : removed) {
+            // A registry that left the cluster took its copy with it.
+            auto node = std::find(cluster.addrs.begin(), cluster.addrs.end(), r.first);
+            if (node == cluster.addrs.end()) continue;
+            int fd = node_sock(cluster, node - cluster.addrs.begin());
+            if (fd < 0 || !send_name_list(fd, ACTION_PUBLISH_REMOVE, r.second.begin(), r.second.end(),
+                                          r.second.size())) {
+                return false;
             }
+            probes.emplace(fd, std::make_pair(r.second.front(), false));
+            n_removed += r.second.size();
+        }
+        for (const auto &a : added) {
+            auto node = std::find(cluster.addrs.begin(), cluster.addrs.end(), a.first);
+            int fd = node_sock(cluster, node - cluster.addrs.begin());
+            if (fd < 0) return false;
 
-        } else if (up == "SEARCH") {
-            std::cout << "Enter a file name: ";
-            std::string fname;
-            if (!std::getline(std::cin, fname)) {
-                std::cerr << "No filename input. Returning to command prompt.\n";
-                continue;
+            // One record per new name; a new hash key no name here carries
+            // goes with some file that has it, whose name this registry
+            // already has or does not own.
+            std::vector<std::pair<std::string, ContentHash>> records;
+            std::set<std::string> carried;
+            for (const auto &key : a.second) {
+                if (is_hash_key(key)) continue;
+                const ContentHash &h = state.hash_of[key];
+                records.emplace_back(key, h);
+                carried.insert(hash_key(h));
             }
-            PeerInfo pi = search_file(sock, fname);
-            if (!pi.found) {
-                std::cout << "File not indexed by registry\n";
-            } else {
-                std::cout << "File found at\n";
-                std::cout << "Peer " << pi.id << "\n";
-                std::cout << pi.ip << ":" << pi.port << "\n";
+            for (const auto &key : a.second) {
+                if (!is_hash_key(key) || carried.count(key) != 0) continue;
+                const std::string &f = *state.files_with[key].begin();
+                records.emplace_back(f, state.hash_of[f]);
             }
-        } else if (up == "FETCH") {
+            if (!send_hashed_list(fd, records)) return false;
+            probes[fd] = std::make_pair(a.second.front(), true);
+            n_added += a.second.size();
+        }
+    }
+    for (const auto &p : probes) {
+        if (!confirm_published(cluster, p.first, p.second.first, p.second.second)) {
+            std::cerr << "Registry did not confirm the PUBLISH.\n";
+            return false;
+        }
+    }
+    if (state.announced) {
+        std::cout << "Published " << n_added << " new, " << n_removed << " removed.\n";
+    }
+    state.announced = true;
+    for (const auto &key : gone) state.names.erase(key);
+    for (const auto &o : owners) state.names[o.first] = o.second;
+    return true;
+}
+
+// Refreshes the cluster map; moved says the member list changed, so every
+// key may have a new owner.
+bool refresh_cluster(RegistryCluster &cluster, bool clustered, bool &moved) {
+    moved = false;
+    if (!clustered) return true;
+    std::vector<std::string> addrs;
+    if (!fetch_cluster_map(cluster.primary, addrs)) return false;
+    std::vector<std::string> before = cluster.addrs;
+    apply_cluster_map(cluster, addrs);
+    moved = cluster.addrs != before;
+    return true;
+}
+
+// Lists and hashes SharedFiles (see HashCache) and publishes the whole of
+// it: the first time everything, afterwards whatever differs from what the
+// registries were last sent (all of it again, if that differs at all, to a
+// standalone registry).
+bool do_publish(RegistryCluster &cluster, bool clustered, PublishState &state) {
+    bool moved;
+    if (!refresh_cluster(cluster, clustered, moved)) return false;
+
+    std::vector<std::string> listed = list_shared_files();
+    std::sort(listed.begin(), listed.end());
+    listed.erase(std::unique(listed.begin(), listed.end()), listed.end());
+
+    std::vector<ContentHash> hashes;
+    std::vector<bool> hashed;
+    hash_cache.hash_all(listed, hashes, hashed);
+    std::set<std::string> affected;
+    for (size_t k = 0; k < listed.size(); ++k) {
+        if (!hashed[k]) std::cerr << "Skipping file '" << listed[k] << "' (cannot read it).\n";
+        set_shared(state, listed[k], hashed[k] ? &hashes[k] : nullptr, affected);
+    }
+    std::vector<std::string> gone;
+    for (const auto &f : state.hash_of) {
+        if (!std::binary_search(listed.begin(), listed.end(), f.first)) gone.push_back(f.first);
+    }
+    for (const auto &f : gone) set_shared(state, f, nullptr, affected);
+
+    all_keys(state, affected);
+    return publish_keys(cluster, clustered, state, affected);
+}
+
+// Publishes what became of the files in dirty, without listing SharedFiles:
+// each is stat()ed, and hashed if it changed, then only the names and hash
+// keys that moved are sent. A standalone registry still gets the whole
+// listing, from what state already holds.
+bool publish_changed(RegistryCluster &cluster, bool clustered, PublishState &state,
+                     const std::set<std::string> &dirty) {
+    bool moved;
+    if (!refresh_cluster(cluster, clustered, moved)) return false;
+
+    std::vector<std::string> present;
+    std::set<std::string> affected;
+    for (const auto &name : dirty) {
+        struct stat st;
+        if (name.size() + 1 <= REGISTRY_NAME_LEN && stat(("SharedFiles/" + name).c_str(), &st) == 0
+            && S_ISREG(st.st_mode)) {
+            present.push_back(name);
+        } else {
+            set_shared(state, name, nullptr, affected);
+        }
+    }
+    std::vector<ContentHash> hashes;
+    std::vector<bool> hashed;
+    hash_cache.hash_all(present, hashes, hashed, false);
+    for (size_t k = 0; k < present.size(); ++k) {
+        set_shared(state, present[k], hashed[k] ? &hashes[k] : nullptr, affected);
+    }
+    // Drop the hashes of contents no longer shared once they pile up.
+    if (hash_cache.size() > 2 * state.hash_of.size() + 1024) {
+        hash_cache.retain([&state](const ContentHash &h) { return state.files_with.count(hash_key(h)) != 0; });
+    }
+
+    if (moved) all_keys(state, affected);
+    return publish_keys(cluster, clustered, state, affected);
+}
+
+// Asks the registry for up to PATTERN_LIMIT names that start with (or, if
+// substring is set, contain) pattern, each with the peer holding it.
+bool search_pattern(int sock, const std::string &pattern, bool substring,
+                    std::vector<std::pair<std::string, PeerInfo>> &results) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    results.clear();
+
+    std::vector<uint8_t> buf(1 + 1 + 4 + REGISTRY_NAME_LEN, 0);
+    buf[0] = ACTION_SEARCH_PATTERN;
+    buf[1] = substring ? 1 : 0;
+    uint32_t net_limit = htonl(PATTERN_LIMIT);
+    std::memcpy(&buf[2], &net_limit, 4);
+    std::memcpy(&buf[6], pattern.data(), std::min(pattern.size(), REGISTRY_NAME_LEN - 1));
+
+    ssize_t sent = SEND_single_call(sock, buf.data(), buf.size());
+    if (sent != static_cast<ssize_t>(buf.size())) {
+        return false;
+    }
+
+    uint32_t count;
+    if (!recv_all(sock, &count, 4)) {
+        std::cerr << "Connection closed by registry while waiting for SEARCH-PATTERN response.\n";
+        return false;
+    }
+    count = ntohl(count);
+    if (count > PATTERN_LIMIT) {
+        std::cerr << "Registry sent " << count << " matches, more than asked for.\n";
+        return false;
+    }
+
+    std::vector<uint8_t> records(count * (REGISTRY_NAME_LEN + 10));
+    if (!recv_all(sock, records.data(), records.size())) {
+        std::cerr << "Incomplete SEARCH-PATTERN response.\n";
+        return false;
+    }
+    for (uint32_t k = 0; k < count; ++k) {
+        const uint8_t *rec = &records[k * (REGISTRY_NAME_LEN + 10)];
+        const char *name = reinterpret_cast<const char *>(rec);
+        results.emplace_back(std::string(name, strnlen(name, REGISTRY_NAME_LEN)),
+                             parse_search_entry(rec + REGISTRY_NAME_LEN));
+    }
+    return true;
+}
+
+// Asks the registry for up to k peers holding filename, in the order they
+// should be tried.
+bool search_holders(int sock, const std::string &filename, uint32_t k,
+                    std::vector<PeerInfo> &results) {
+    std::lock_guard<std::mutex> lock(registry_mu);
+    results.clear();
+
+    std::vector<uint8_t> buf(1 + 4 + REGISTRY_NAME_LEN, 0);
+    buf[0] = ACTION_SEARCH_MULTI;
+    uint32_t net_k = htonl(k);
+    std::memcpy(&buf[1], &net_k, 4);
+    std::memcpy(&buf[5], filename.data(), std::min(filename.size(), REGISTRY_NAME_LEN - 1));
+
+    ssize_t sent = SEND_single_call(sock, buf.data(), buf.size());
+    if (sent != static_cast<ssize_t>(buf.size())) {
+        return false;
+    }
+
+    uint32_t count;
+    if (!recv_all(sock, &count, 4)) {
+        std::cerr << "Connection closed by registry while waiting for SEARCH response.\n";
+        return false;
+    }
+    count = ntohl(count);
+    if (count > k) {
+        std::cerr << "Registry sent " << count << " holders, more than asked for.\n";
+        return false;
+    }
+
+    std::vector<uint8_t> entries(count * 10);
+    if (!recv_all(sock, entries.data(), entries.size())) {
+        std::cerr << "Incomplete SEARCH response.\n";
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        results.push_back(parse_search_entry(&entries[i * 10]));
+    }
+    return true;
+}
+
+// Sends HEARTBEAT on every open registry socket from a background thread
+// until stopped.
+class Heartbeat {
+public:
+    explicit Heartbeat(const RegistryCluster &c) : cluster(c), worker(&Heartbeat::run, this) {}
+
+    ~Heartbeat() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mu);
+        while (!wake.wait_for(lock, HEARTBEAT_INTERVAL, [this] { return stopping; })) {
+            std::lock_guard<std::mutex> io(registry_mu);
+            std::vector<int> socks = cluster.socks;
+            socks.push_back(cluster.primary);
+            std::sort(socks.begin(), socks.end());
+            socks.erase(std::unique(socks.begin(), socks.end()), socks.end());
+            for (int fd : socks) {
+                if (fd >= 0) send(fd, &ACTION_HEARTBEAT, 1, MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    const RegistryCluster &cluster;
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread worker;
+};
+
+// --watch: after the first PUBLISH, follows SharedFiles with inotify and
+// publishes what changed, so the directory is listed only once. A file
+// counts as changed when whoever wrote it closes it, or when it is moved
+// in or out or deleted. Events are coalesced into one delta, sent once
+// the directory has been quiet for WATCH_QUIET (or busy for WATCH_MAX_DELAY)
+// and never sooner than WATCH_MIN_INTERVAL after the last; in between the
+// thread sleeps in poll(). If events were lost, or a delta could not be
+// sent, the next one is a full PUBLISH instead.
+class SharedWatcher {
+public:
+    SharedWatcher(RegistryCluster &c, bool is_clustered, PublishState &s)
+        : cluster(c), clustered(is_clustered), state(s) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (inotify_fd < 0 || stop_fd < 0) {
+            std::perror("inotify");
+            return;
+        }
+        add_watch();
+        worker = std::thread(&SharedWatcher::run, this);
+    }
+    SharedWatcher(const SharedWatcher &) = delete;
+    SharedWatcher &operator=(const SharedWatcher &) = delete;
+
+    ~SharedWatcher() {
+        if (worker.joinable()) {
+            uint64_t one = 1;
+            if (write(stop_fd, &one, sizeof(one)) < 0) std::perror("eventfd");
+            worker.join();
+        }
+        if (inotify_fd >= 0) close(inotify_fd);
+        if (stop_fd >= 0) close(stop_fd);
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE
+                                         | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    void add_watch() {
+        wd = inotify_add_watch(inotify_fd, "SharedFiles", WATCH_EVENTS);
+    }
+
+    void run() {
+        Clock::time_point last_flush = Clock::now() - WATCH_MIN_INTERVAL;
+        Clock::time_point first_event, last_event;
+        while (true) {
+            bool pending = rescan || !dirty.empty();
+            int timeout = -1;
+            if (pending) {
+                auto due = std::max(last_flush + (failed ? WATCH_RETRY : WATCH_MIN_INTERVAL),
+                                    std::min(last_event + WATCH_QUIET, first_event + WATCH_MAX_DELAY));
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - Clock::now());
+                timeout = static_cast<int>(std::max<long long>(wait.count(), 0));
+            } else if (wd < 0) {
+                // SharedFiles is gone; look for it again now and then.
+                timeout = std::chrono::duration_cast<std::chrono::milliseconds>(WATCH_RETRY).count();
+            }
+
+            struct pollfd fds[2] = {{stop_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+            int n = poll(fds, 2, timeout);
+            if (n < 0 && errno != EINTR) {
+                std::perror("poll");
+                return;
+            }
+            if (fds[0].revents != 0) return;
+            if (n > 0 && fds[1].revents != 0) {
+                if (!pending) first_event = Clock::now();
+                last_event = Clock::now();
+                read_events();
+                continue;
+            }
+            if (wd < 0) {
+                add_watch();
+                if (wd >= 0 && !pending) {
+                    rescan = true;
+                    first_event = last_event = Clock::now();
+                }
+            }
+            if (pending && n == 0) {
+                flush();
+                last_flush = Clock::now();
+            }
+        }
+    }
+
+    void read_events() {
+        alignas(struct inotify_event) char buf[64 * 1024];
+        while (true) {
+            ssize_t len = read(inotify_fd, buf, sizeof(buf));
+            if (len <= 0) return;
+            for (char *p = buf; p < buf + len;) {
+                const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    rescan = true;
+                } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    if (ev->mask & IN_MOVE_SELF) inotify_rm_watch(inotify_fd, wd);
+                    wd = -1;
+                    rescan = true;
+                } else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+                    dirty.insert(ev->name);
+                }
+            }
+        }
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(command_mu);
+        if (!state.announced) {
+            // The first PUBLISH failed; the next one lists everything anyway.
+            dirty.clear();
+            rescan = false;
+            return;
+        }
+        bool ok = rescan ? do_publish(cluster, clustered, state) : publish_changed(cluster, clustered, state, dirty);
+        failed = !ok;
+        if (ok) {
+            dirty.clear();
+            rescan = false;
+        } else {
+            std::cerr << "Automatic PUBLISH failed; will retry.\n";
+            rescan = true;
+        }
+        std::cout.flush();     // the prompt is not going to flush it
+    }
+
+    RegistryCluster &cluster;
+    bool clustered;
+    PublishState &state;
+    int inotify_fd = -1;
+    int stop_fd = -1;
+    int wd = -1;
+    std::set<std::string> dirty;    // names with events since the last delta
+    bool rescan = false;
+    bool failed = false;
+    std::thread worker;
+};
+
+// Serves FETCH and FETCH_RANGE for the files in SharedFiles. The registries
+// record this peer under the address of its registry connection, so the
+// server listens on that same port. One epoll thread handles every
+// downloader; file bytes go from the page cache to the socket with
+// sendfile(), or through a pipe with splice() where sendfile() is refused,
+// and never pass through this process's memory.
+class UploadServer {
+public:
+    explicit UploadServer(int listen_fd) : listener(listen_fd) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        watch(listener, EPOLLIN, EPOLL_CTL_ADD);
+        watch(stop_fd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wake_fd, EPOLLIN, EPOLL_CTL_ADD);
+        worker = std::thread(&UploadServer::run, this);
+    }
+
+    ~UploadServer() {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) std::perror("eventfd");
+        worker.join();
+        for (auto &c : conns) finish(*c.second);
+        close(listener);
+        close(stop_fd);
+        close(wake_fd);
+        close(epfd);
+    }
+
+    // Bound to port on every address, the same family as the registry link.
+    static int listen_on(int family, uint16_t port) {
+        int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        // Accepted sockets inherit the send buffer size.
+        if (transfer_sndbuf > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &transfer_sndbuf, sizeof(transfer_sndbuf));
+        }
+        if (!share_local_port(fd, family, port) || listen(fd, UPLOAD_BACKLOG) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+private:
+    static const int UPLOAD_BACKLOG = 128;
+    static const int MAX_EVENTS = 64;
+    // Bytes one downloader may send per wakeup before the others get a turn.
+    static const size_t SEND_QUANTUM = 1 << 20;
+    static const size_t MAX_REQUEST = 1 + 16 + 256;
+
+    struct Conn {
+        int fd = -1;
+        std::string in;             // request bytes not yet parsed
+        std::string head;           // reply header still to send
+        size_t head_sent = 0;
+        int file = -1;
+        off_t offset = 0;           // next file byte to send
+        uint64_t left = 0;          // file bytes still to send
+        bool close_after = false;   // plain FETCH: closing marks end of file
+        bool use_splice = false;
+        int pipe_rd = -1, pipe_wr = -1;
+        size_t in_pipe = 0;         // spliced in from the file, not yet sent
+        std::unique_ptr<BlockCompressor> stream;    // compressed reply
+        std::string frame;          // frame from stream being sent
+        size_t frame_sent = 0;
+        bool starved = false;       // waiting for stream to compress more
+    };
+
+    void watch(int fd, uint32_t events, int op) {
+        struct epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, op, fd, &ev) < 0) std::perror("epoll_ctl");
+    }
+
+    void run() {
+        struct epoll_event events[MAX_EVENTS];
+        while (true) {
+            int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                std::perror("epoll_wait");
+                return;
+            }
+            for (int e = 0; e < n; ++e) {
+                int fd = events[e].data.fd;
+                if (fd == stop_fd) return;
+                if (fd == listener) {
+                    accept_all();
+                    continue;
+                }
+                if (fd == wake_fd) {
+                    resume_starved();
+                    continue;
+                }
+                auto it = conns.find(fd);
+                if (it != conns.end()) step(it, (events[e].events & (EPOLLERR | EPOLLHUP)) != 0);
+            }
+        }
+    }
+
+    // Serves a connection and rearms it, or closes it. A connection waiting
+    // on its compressor is not polled at all until the compressor wakes it.
+    void step(std::unordered_map<int, std::unique_ptr<Conn>>::iterator it, bool hung_up) {
+        Conn &c = *it->second;
+        if (!hung_up && serve(c)) {
+            uint32_t events = c.starved ? 0 : c.head.empty() && c.left == 0 ? EPOLLIN : EPOLLOUT;
+            watch(c.fd, events, EPOLL_CTL_MOD);
+            return;
+        }
+        finish(c);
+        conns.erase(it);
+    }
+
+    // Called on a compressor thread once it has a frame for fd.
+    void wake(int fd) {
+        {
+            std::lock_guard<std::mutex> lock(woken_mu);
+            woken.push_back(fd);
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) std::perror("eventfd");
+    }
+
+    void resume_starved() {
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) std::perror("eventfd");
+        std::vector<int> fds;
+        {
+            std::lock_guard<std::mutex> lock(woken_mu);
+            fds.swap(woken);
+        }
+        for (int fd : fds) {
+            auto it = conns.find(fd);
+            if (it == conns.end() || !it->second->starved) continue;
+            it->second->starved = false;
+            step(it, false);
+        }
+    }
+
+    void accept_all() {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) std::perror("accept");
+                if (errno == EINTR) continue;
+                return;
+            }
+            std::unique_ptr<Conn> c(new Conn());
+            c->fd = fd;
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            conns[fd] = std::move(c);
+        }
+    }
+
+    void finish(Conn &c) {
+        c.stream.reset();       // stops its thread before the file goes
+        if (c.file >= 0) close(c.file);
+        if (c.pipe_rd >= 0) close(c.pipe_rd);
+        if (c.pipe_wr >= 0) close(c.pipe_wr);
+        close(c.fd);
+    }
+
+    // Reads requests and sends replies until the socket would block.
+    // Returns false when the connection should be closed.
+    bool serve(Conn &c) {
+        while (true) {
+            if (!c.head.empty() || c.left > 0) {
+                bool done = false;
+                if (!send_reply(c, done)) return false;
+                if (!done) return true;
+                if (c.close_after) return false;
+                continue;
+            }
+            if (parse_request(c)) continue;
+            if (c.in.size() > MAX_REQUEST) return false;
+
+            char buf[512];
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+            return false;
+        }
+    }
+
+    // Starts the reply to the next complete request in c.in, if there is one.
+    bool parse_request(Conn &c) {
+        if (c.in.empty()) return false;
+        uint8_t action = c.in[0];
+        bool compress = action == (ACTION_FETCH_RANGE | FETCH_FLAG_COMPRESS);
+        if (compress) action = ACTION_FETCH_RANGE;
+        size_t name_at = action == ACTION_FETCH_RANGE ? 17 : 1;
+        if (action != 3 && action != ACTION_FETCH_RANGE) {
+            c.close_after = true;
+            c.head.assign(1, '\1');
+            return true;
+        }
+        size_t nul = c.in.find('\0', name_at);
+        if (c.in.size() < name_at || nul == std::string::npos) return false;
+
+        std::string name = c.in.substr(name_at, nul - name_at);
+        uint64_t offset = 0, length = 0;
+        if (action == ACTION_FETCH_RANGE) {
+            std::memcpy(&offset, &c.in[1], 8);
+            std::memcpy(&length, &c.in[9], 8);
+            offset = be64toh(offset);
+            length = be64toh(length);
+        }
+        c.in.erase(0, nul + 1);
+
+        uint64_t size = 0;
+        std::string file;
+        c.file = open_shared(name, size, file);
+        c.head_sent = 0;
+        if (c.file < 0) {
+            // A ranged reply is framed even when empty; the link stays up.
+            c.close_after = action != ACTION_FETCH_RANGE;
+            c.head.assign(action == ACTION_FETCH_RANGE ? 17 : 1, '\0');
+            c.head[0] = 1;
+            return true;
+        }
+
+        if (action == 3) {
+            c.close_after = true;
+            c.head.assign(1, '\0');
+            c.offset = 0;
+            c.left = size;
+        } else {
+            uint64_t count = offset < size ? std::min(length, size - offset) : 0;
+            uint64_t size_net = htobe64(size);
+            uint64_t count_net = htobe64(count);
+            c.head.assign(17, '\0');
+            std::memcpy(&c.head[1], &size_net, 8);
+            std::memcpy(&c.head[9], &count_net, 8);
+            c.offset = static_cast<off_t>(offset);
+            c.left = count;
+            if (compress && count >= COMPRESS_MIN_BYTES && !looks_compressed(file) && start_stream(c, count)) {
+                c.head[0] = FETCH_COMPRESSED;
+                c.left = 0;
+            }
+        }
+        if (c.left == 0 && !c.stream) {
+            close(c.file);
+            c.file = -1;
+        }
+        return true;
+    }
+
+    // Only plain names of regular files directly inside SharedFiles, or the
+    // hash key of one as of the last PUBLISH; file is the name in there.
+    static int open_shared(const std::string &name, uint64_t &size, std::string &file) {
+        if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+            return -1;
+        }
+        file = name;
+        if (is_hash_key(name)) {
+            std::lock_guard<std::mutex> lock(shared_hashes_mu);
+            auto found = shared_hashes.find(name);
+            if (found == shared_hashes.end()) return -1;
+            file = found->second;
+        }
+        int fd = open(("SharedFiles/" + file).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+        return fd;
+    }
+
+    // Sends the header, then up to SEND_QUANTUM file bytes. done is set once
+    // the whole reply is out. Returns false on a broken connection.
+    bool send_reply(Conn &c, bool &done) {
+        done = false;
+        while (c.head_sent < c.head.size()) {
+            ssize_t n = send(c.fd, c.head.data() + c.head_sent, c.head.size() - c.head_sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            c.head_sent += n;
+        }
+        if (c.stream) return send_frames(c, done);
+
+        size_t budget = SEND_QUANTUM;
+        while (c.left > 0 && budget > 0) {
+            size_t want = std::min<uint64_t>(c.left, budget);
+            ssize_t n = c.use_splice ? splice_some(c, want) : sendfile(c.fd, c.file, &c.offset, want);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if (!c.use_splice && (errno == EINVAL || errno == ENOSYS)) {
+                    c.use_splice = true;
+                    continue;
+                }
+                return false;
+            }
+            if (n == 0) return false;       // the file shrank under us
+            c.left -= n;
+            budget -= n;
+        }
+        if (c.left > 0) return true;
+
+        c.head.clear();
+        c.head_sent = 0;
+        if (c.file >= 0) {
+            close(c.file);
+            c.file = -1;
+        }
+        done = true;
+        return true;
+    }
+
+    // Hands the count bytes at c.offset to a BlockCompressor, unless a
+    // sample from the start shows they would not shrink.
+    bool start_stream(Conn &c, uint64_t count) {
+        std::vector<uint8_t> sample(std::min<uint64_t>(count, COMPRESS_PROBE_BYTES));
+        ssize_t n = pread(c.file, sample.data(), sample.size(), c.offset);
+        if (n <= 0 || !worth_compressing(sample.data(), n)) return false;
+        int fd = c.fd;
+        c.stream.reset(new BlockCompressor(c.file, c.offset, count, [this, fd] { wake(fd); }));
+        c.frame.clear();
+        c.frame_sent = 0;
+        return true;
+    }
+
+    // send_reply() for a compressed reply: frames as the compressor has
+    // them. When it has none yet the connection is marked starved.
+    bool send_frames(Conn &c, bool &done) {
+        size_t budget = SEND_QUANTUM;
+        while (true) {
+            if (c.frame_sent == c.frame.size()) {
+                c.frame.clear();
+                c.frame_sent = 0;
+                BlockCompressor::State state = c.stream->next(c.frame);
+                if (state == BlockCompressor::FAILED) return false;
+                if (state == BlockCompressor::DONE) break;
+                if (state == BlockCompressor::WAIT) {
+                    c.starved = true;
+                    return true;
+                }
+            }
+            if (budget == 0) return true;
+            size_t want = std::min(c.frame.size() - c.frame_sent, budget);
+            ssize_t n = send(c.fd, c.frame.data() + c.frame_sent, want, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            c.frame_sent += n;
+            budget -= n;
+        }
+
+        c.stream.reset();
+        close(c.file);
+        c.file = -1;
+        c.head.clear();
+        c.head_sent = 0;
+        done = true;
+        return true;
+    }
+
+    // File to pipe, pipe to socket: still no copy through user space.
+    ssize_t splice_some(Conn &c, size_t want) {
+        if (c.pipe_rd < 0) {
+            int p[2];
+            if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+            c.pipe_rd = p[0];
+            c.pipe_wr = p[1];
+        }
+        if (c.in_pipe == 0) {
+            ssize_t n = splice(c.file, &c.offset, c.pipe_wr, nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0) return n;
+            c.in_pipe = n;
+        }
+        ssize_t n = splice(c.pipe_rd, nullptr, c.fd, nullptr, c.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) c.in_pipe -= n;
+        return n;
+    }
+
+    int listener;
+    int epfd = -1;
+    int stop_fd = -1;
+    int wake_fd = -1;
+    std::mutex woken_mu;
+    std::vector<int> woken;     // connections whose compressor has frames
+    std::unordered_map<int, std::unique_ptr<Conn>> conns;
+    std::thread worker;
+};
+
+int fetch_file_from_peer(const PeerInfo &peer, const std::string &filename) {
+    int peer_sock = connect_to_peer(peer);
+    if (peer_sock < 0) {
+        return -1;
+    }
+
+    std::vector<uint8_t> buf;
+    buf.reserve(1 + filename.size() + 1);
+    buf.push_back(3);
+    buf.insert(buf.end(), filename.begin(), filename.end());
+    buf.push_back('\0');
+
+    ssize_t snt = SEND_single_call(peer_sock, buf.data(), buf.size());
+    uint8_t status = 1;
+    if (snt < 0 || !recv_all(peer_sock, &status, 1) || status != 0) {
+        std::cerr << "Peer " << peer.id << " could not send " << filename << ".\n";
+        close(peer_sock);
+        return -1;
+    }
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::perror("open");
+        close(peer_sock);
+        return -1;
+    }
+    // The plain FETCH reply runs until the peer closes.
+    long long got = receive_to_file(peer_sock, fd, -1);
+    close(fd);
+    close(peer_sock);
+    if (got < 0) {
+        std::cerr << "Error receiving file data from peer.\n";
+        return -1;
+    }
+    return 0;
+}
+
+bool send_range_request(int sock, const std::string &filename, uint64_t offset, uint64_t length,
+                        bool compress = false) {
+    std::vector<uint8_t> buf(1 + 8 + 8);
+    buf[0] = ACTION_FETCH_RANGE | (compress ? FETCH_FLAG_COMPRESS : 0);
+    uint64_t off_net = htobe64(offset);
+    uint64_t len_net = htobe64(length);
+    std::memcpy(&buf[1], &off_net, 8);
+    std::memcpy(&buf[9], &len_net, 8);
+    buf.insert(buf.end(), filename.begin(), filename.end());
+    buf.push_back('\0');
+    return send_all(sock, buf.data(), buf.size());
+}
+
+// Reads a ranged FETCH reply header. False if the connection broke; status
+// is 0 when the holder has the file.
+bool read_range_reply(int sock, uint8_t &status, uint64_t &file_size, uint64_t &count) {
+    uint8_t hdr[17];
+    if (!recv_all(sock, hdr, sizeof(hdr))) {
+        return false;
+    }
+    status = hdr[0];
+    std::memcpy(&file_size, hdr + 1, 8);
+    std::memcpy(&count, hdr + 9, 8);
+    file_size = be64toh(file_size);
+    count = be64toh(count);
+    return true;
+}
+
+// Sends a ranged FETCH and reads the reply header. False if the holder
+// refuses or does not speak FETCH_RANGE.
+bool request_range(int sock, const std::string &filename, uint64_t offset, uint64_t length,
+                   uint64_t &file_size, uint64_t &count) {
+    uint8_t status = 1;
+    return send_range_request(sock, filename, offset, length)
+        && read_range_reply(sock, status, file_size, count) && status == 0;
+}
+
+// Idle download connections to other peers, kept open between FETCHes so a
+// run of small files does not pay a TCP handshake and slow start each time.
+class PeerConnPool {
+public:
+    ~PeerConnPool() {
+        for (auto &h : idle) {
+            for (const Idle &i : h.second) close(i.sock);
+        }
+    }
+
+    // An idle connection to peer if there is a live one, else a new one.
+    // reused tells the caller a failure may just mean the holder hung up.
+    int acquire(const PeerInfo &peer, bool &reused) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            std::vector<Idle> &list = idle[key(peer)];
+            auto now = std::chrono::steady_clock::now();
+            while (!list.empty()) {
+                Idle i = list.back();
+                list.pop_back();
+                if (now - i.since < POOL_IDLE_TIMEOUT && still_open(i.sock)) {
+                    reused = true;
+                    return i.sock;
+                }
+                close(i.sock);
+            }
+        }
+        reused = false;
+        return connect_to_peer(peer);
+    }
+
+    // Only for connections with no reply outstanding.
+    void release(const PeerInfo &peer, int sock) {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<Idle> &list = idle[key(peer)];
+        if (list.size() >= POOL_IDLE_PER_HOLDER) {
+            close(sock);
+            return;
+        }
+        list.push_back(Idle{sock, std::chrono::steady_clock::now()});
+    }
+
+private:
+    struct Idle {
+        int sock;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    static std::string key(const PeerInfo &peer) {
+        return peer.ip + ":" + std::to_string(peer.port);
+    }
+
+    // An idle connection has nothing to read unless the holder closed it.
+    static bool still_open(int sock) {
+        struct pollfd p = {sock, POLLIN, 0};
+        return poll(&p, 1, 0) == 0;
+    }
+
+    std::mutex mu;
+    std::map<std::string, std::vector<Idle>> idle;
+};
+
+PeerConnPool peer_pool;
+
+// Receives a whole size-byte file in FETCH_CHUNK pieces, journaling each,
+// so that if the transfer breaks a retry only fetches the rest. A
+// compressed reply is journaled a block at a time as each is inflated.
+bool receive_journaled(int sock, int fd, const std::string &name, uint64_t size, bool compressed) {
+    FetchJournal journal(name, size);
+    if (!journal.start(fd, false)) {
+        long long got = compressed ? receive_compressed(sock, fd, size) : receive_to_file(sock, fd, size);
+        return got == (long long)size;
+    }
+    if (compressed) {
+        bool ok = receive_compressed(sock, fd, size, [&journal](uint64_t off, uint64_t len) {
+            journal.record(off, len);
+        }) == (long long)size;
+        if (ok) {
+            journal.finish();
+        } else {
+            journal.flush();
+        }
+        return ok;
+    }
+    uint64_t off = 0;
+    while (off < size) {
+        uint64_t step = std::min(FETCH_CHUNK, size - off);
+        if (receive_to_file(sock, fd, step) != (long long)step) {
+            off_t at = lseek(fd, 0, SEEK_CUR);
+            if (at > (off_t)off) journal.record(off, at - off);
+            journal.flush();
+            return false;
+        }
+        journal.record(off, step);
+        off += step;
+    }
+    journal.finish();
+    return true;
+}
+
+// Fetches names from one holder over a pooled connection, keeping up to
+// FETCH_PIPELINE_DEPTH requests in flight so small files are not each a
+// round trip. done[k] is set for every file stored. Returns false if the
+// holder could not be reached or does not serve ranged requests, before
+// any reply; the caller can fall back to plain FETCH.
+bool fetch_files_pipelined(const PeerInfo &peer, const std::vector<std::string> &names,
+                           std::vector<bool> &done) {
+    done.assign(names.size(), false);
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        bool reused = false;
+        int sock = peer_pool.acquire(peer, reused);
+        if (sock < 0) return false;
+
+        size_t sent = 0, replied = 0;
+        bool broken = false;
+        while (replied < names.size() && !broken) {
+            while (sent < names.size() && sent - replied < FETCH_PIPELINE_DEPTH) {
+                if (!send_range_request(sock, names[sent], 0, FETCH_WHOLE, fetch_compressed)) break;
+                ++sent;
+            }
+            uint8_t status = 1;
+            uint64_t size = 0, count = 0;
+            if (sent == replied || !read_range_reply(sock, status, size, count)) {
+                broken = true;
+                break;
+            }
+            const std::string &name = names[replied++];
+            if (status != 0 && status != FETCH_COMPRESSED) {
+                std::cerr << "Peer " << peer.id << " does not have " << name << ".\n";
+                continue;
+            }
+            bool compressed = status == FETCH_COMPRESSED;
+            int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                std::perror("open");
+                broken = true;      // the file bytes are still on the wire
+                break;
+            }
+            if (count >= JOURNAL_MIN_BYTES) {
+                done[replied - 1] = receive_journaled(sock, fd, name, count, compressed);
+            } else {
+                long long got = compressed ? receive_compressed(sock, fd, count) : receive_to_file(sock, fd, count);
+                done[replied - 1] = got == (long long)count;
+            }
+            close(fd);
+            broken = !done[replied - 1];
+        }
+
+        if (!broken) {
+            peer_pool.release(peer, sock);
+            return true;
+        }
+        close(sock);
+        // A pooled connection the holder dropped fails on the first reply;
+        // try once more on a fresh one. Anything later is a real failure.
+        if (replied > 0 || !reused) return replied > 0;
+    }
+    return false;
+}
+
+// One download spread over several holders. The file is cut into
+// FETCH_CHUNK ranges that idle sources take in order; once none are left,
+// an idle source splits the range of the source expected to finish last and
+// takes the far end, sized so both should finish together. Every received
+// block is pwrite()n straight into place.
+struct ChunkedDownload {
+    struct Source {
+        PeerInfo peer;
+        uint64_t next = 0;          // current range is [next, end)
+        uint64_t end = 0;
+        uint64_t bytes = 0;         // received so far
+        std::chrono::steady_clock::time_point started;
+    };
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<std::pair<uint64_t, uint64_t>> todo;
+    std::vector<Source> sources;
+    int fd = -1;
+    FetchJournal *journal = nullptr;    // null for small downloads
+    uint64_t size = 0;
+    size_t splits = 0;
+    bool failed = false;
+
+    bool finished() const {
+        if (!todo.empty()) return false;
+        for (const Source &s : sources) {
+            if (s.next != s.end) return false;
+        }
+        return true;
+    }
+
+    double rate(const Source &s, std::chrono::steady_clock::time_point now) const {
+        double secs = std::chrono::duration<double>(now - s.started).count();
+        return (s.bytes + 1) / (secs + 1e-3);
+    }
+
+    // Gives sources[me] part of another source's range. Caller holds mu.
+    bool steal(size_t me) {
+        auto now = std::chrono::steady_clock::now();
+        size_t victim = sources.size();
+        double worst = 0;
+        for (size_t j = 0; j < sources.size(); ++j) {
+            uint64_t left = sources[j].end - sources[j].next;
+            if (j == me || left < 2 * MIN_STEAL) continue;
+            double eta = left / rate(sources[j], now);
+            if (eta > worst) {
+                worst = eta;
+                victim = j;
+            }
+        }
+        if (victim == sources.size()) return false;
+
+        Source &v = sources[victim];
+        uint64_t left = v.end - v.next;
+        double r_v = rate(v, now);
+        double r_me = rate(sources[me], now);
+        uint64_t keep = static_cast<uint64_t>(left * (r_v / (r_v + r_me)));
+        keep = std::min(std::max(keep, MIN_STEAL), left - MIN_STEAL);
+        sources[me].next = v.next + keep;
+        sources[me].end = v.end;
+        v.end = v.next + keep;
+        ++splits;
+        return true;
+    }
+};
+
+void run_chunk_source(ChunkedDownload &d, size_t me, const std::string &filename) {
+    ChunkedDownload::Source &src = d.sources[me];
+    std::vector<uint8_t> buf(64 * 1024);
+    int sock = -1;
+
+    std::unique_lock<std::mutex> lock(d.mu);
+    src.started = std::chrono::steady_clock::now();
+    while (!d.failed) {
+        if (src.next == src.end) {
+            if (!d.todo.empty()) {
+                src.next = d.todo.front().first;
+                src.end = d.todo.front().second;
+                d.todo.pop_front();
+            } else if (!d.steal(me)) {
+                if (d.finished()) break;
+                d.cv.wait(lock);
+                continue;
+            }
+        }
+        uint64_t begin = src.next;
+        uint64_t asked = src.end - begin;
+        lock.unlock();
+
+        bool ok = true;
+        if (sock < 0) {
+            bool reused = false;
+            sock = peer_pool.acquire(src.peer, reused);
+            ok = sock >= 0;
+        }
+        uint64_t file_size = 0, count = 0;
+        ok = ok && request_range(sock, filename, begin, asked, file_size, count)
+                && file_size == d.size && count == asked;
+
+        // Receive until the range is done; it may shrink under us if
+        // another source steals its tail. written counts what landed in
+        // [begin, ...) for the journal.
+        uint64_t got = 0, written = 0;
+        bool cut_short = false;
+        while (ok && got < count) {
+            ssize_t n = recv(sock, buf.data(), std::min<uint64_t>(buf.size(), count - got), 0);
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            lock.lock();
+            uint64_t pos = src.next;
+            uint64_t take = std::min<uint64_t>(n, src.end - pos);
+            src.next += take;
+            src.bytes += n;
+            bool range_done = src.next == src.end;
+            lock.unlock();
+
+            if (take > 0 && pwrite(d.fd, buf.data(), take, pos) != (ssize_t)take) {
+                std::perror("pwrite");
+                lock.lock();
+                d.failed = true;
+                d.cv.notify_all();
+                lock.unlock();
+                ok = false;
+                break;
+            }
+            got += n;
+            written += take;
+            if (range_done && got < count) {
+                // The rest was stolen; this connection is still streaming
+                // it, so drop the connection rather than drain it.
+                cut_short = true;
+                break;
+            }
+        }
+        if (d.journal != nullptr) d.journal->record(begin, written);
+
+        lock.lock();
+        if (!ok) {
+            // Hand back whatever this source still owed and retire it.
+            if (src.next < src.end) d.todo.emplace_front(src.next, src.end);
+            src.next = src.end;
+            d.cv.notify_all();
+            if (sock >= 0) close(sock);
+            sock = -1;
+            break;
+        }
+        if (cut_short) {
+            close(sock);
+            sock = -1;
+        }
+        d.cv.notify_all();
+    }
+    lock.unlock();
+    // Every reply on it was read to the end.
+    if (sock >= 0) peer_pool.release(src.peer, sock);
+}
+
+// Fetches filename from all of holders at once. Returns -1 if none of them
+// serves ranged FETCH or the download could not be completed. Large
+// downloads are journaled; if a journal from an earlier attempt matches,
+// only the ranges it does not list are fetched.
+int fetch_file_multi(const std::vector<PeerInfo> &holders, const std::string &filename) {
+    uint64_t size = 0;
+    bool probed = false;
+    for (const PeerInfo &pi : holders) {
+        bool reused = false;
+        int s = peer_pool.acquire(pi, reused);
+        if (s < 0) continue;
+        uint64_t count = 0;
+        probed = request_range(s, filename, 0, 0, size, count);
+        if (probed) {
+            peer_pool.release(pi, s);
+            break;
+        }
+        close(s);
+    }
+    if (!probed) return -1;
+
+    FetchJournal journal(filename, size);
+    bool resumed = journal.load() && access(filename.c_str(), F_OK) == 0;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        std::perror("open");
+        return -1;
+    }
+    // Reserve the blocks up front; ftruncate() where that is not supported.
+    if (size > 0 && fallocate(fd, 0, 0, size) < 0 && ftruncate(fd, size) < 0) {
+        std::perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    ChunkedDownload d;
+    d.fd = fd;
+    d.size = size;
+    if ((resumed || size >= JOURNAL_MIN_BYTES) && journal.start(fd, resumed)) d.journal = &journal;
+    if (resumed) {
+        std::cout << "Resuming " << filename << ": " << journal.stored() << " of " << size
+                  << " bytes already stored\n";
+    }
+    for (const auto &gap : journal.missing()) {
+        for (uint64_t off = gap.first; off < gap.second; off += FETCH_CHUNK) {
+            d.todo.emplace_back(off, std::min(off + FETCH_CHUNK, gap.second));
+        }
+    }
+    d.sources.resize(holders.size());
+    for (size_t i = 0; i < holders.size(); ++i) d.sources[i].peer = holders[i];
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < holders.size(); ++i) {
+        workers.emplace_back(run_chunk_source, std::ref(d), i, std::cref(filename));
+    }
+    for (auto &w : workers) w.join();
+
+    if (d.failed || !d.finished()) {
+        journal.flush();
+        close(fd);
+        std::cerr << "Multi-source fetch of " << filename << " did not complete.\n";
+        return -1;
+    }
+    if (d.journal != nullptr) journal.finish();
+    close(fd);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Fetched " << size << " bytes from " << holders.size() << " holders in "
+              << secs << " s (" << d.splits << " ranges split)\n";
+    for (const auto &s : d.sources) {
+        std::cout << "  Peer " << s.peer.id << " " << s.peer.ip << ":" << s.peer.port
+                  << ": " << s.bytes << " bytes\n";
+    }
+    return 0;
+}
+
+// Non-empty lines of path, each name once, in the order first listed; two
+// downloads of one name would write the same file. False if it cannot be
+// opened.
+bool read_name_list(const std::string &path, std::vector<std::string> &names) {
+    std::ifstream list(path);
+    if (!list) {
+        std::cerr << "Cannot open '" << path << "'.\n";
+        return false;
+    }
+    names.clear();
+    std::set<std::string> seen;
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && seen.insert(line).second) names.push_back(line);
+    }
+    return true;
+}
+
+// First holder of every name, with one SEARCH_BATCH per owning registry;
+// results are in the order of names. Names the filters rule out are not
+// sent at all. A standalone registry has no SEARCH_BATCH and is asked one
+// name at a time.
+bool resolve_many(RegistryCluster &cluster, const std::vector<std::string> &names,
+                  std::vector<PeerInfo> &results) {
+    if (!cluster.extended) {
+        results.clear();
+        for (const auto &name : names) results.push_back(search_file(cluster.primary, name));
+        return true;
+    }
+    std::map<size_t, std::vector<size_t>> by_node;
+    for (size_t k = 0; k < names.size(); ++k) {
+        if (!definitely_absent(cluster, names[k])) by_node[cluster.owner(names[k])].push_back(k);
+    }
+    results.assign(names.size(), PeerInfo{0, "", 0, false});
+    for (const auto &group : by_node) {
+        std::vector<std::string> part;
+        for (size_t k : group.second) part.push_back(names[k]);
+        std::vector<PeerInfo> part_results;
+        int fd = node_sock(cluster, group.first);
+        if (fd < 0 || !search_many(fd, part, part_results)) {
+            return false;
+        }
+        for (size_t j = 0; j < group.second.size(); ++j) {
+            results[group.second[j]] = part_results[j];
+        }
+    }
+    return true;
+}
+
+// Up to FETCH_CANDIDATES holders of name, from the search cache when it has
+// a fresh answer; from_cache says which. An empty list means not indexed.
+// False if the registry could not be asked. A standalone registry has no
+// SEARCH_MULTI, so it only ever names one holder.
+bool find_holders(RegistryCluster &cluster, const std::string &name,
+                  std::vector<PeerInfo> &holders, bool &from_cache) {
+    holders.clear();
+    from_cache = false;
+    if (definitely_absent(cluster, name)) return true;
+    if (search_cache.lookup(name, holders)) {
+        from_cache = true;
+        return true;
+    }
+    int fd = sock_for(cluster, name);
+    if (fd < 0) return false;
+    if (!cluster.extended) {
+        PeerInfo pi = search_file(fd, name);
+        if (pi.found) holders.push_back(pi);
+    } else if (!search_holders(fd, name, FETCH_CANDIDATES, holders)) {
+        return false;
+    }
+    search_cache.store(name, holders);
+    return true;
+}
+
+// A file fetched by hash key must hash to that key; if not, it is deleted.
+bool check_fetched(const std::string &name) {
+    if (!is_hash_key(name)) return true;
+    ContentHash h;
+    if (hash_file(name, h) && hash_key(h) == name) return true;
+    std::cerr << "Content of " << name << " does not match its hash; discarded.\n";
+    unlink(name.c_str());
+    return false;
+}
+
+// Several holders: pull ranges from all of them at once. Otherwise, or if
+// they do not serve ranges, fetch whole from one holder over a pooled
+// connection, falling back to plain FETCH and then to the next holder.
+bool fetch_from_holders(const std::vector<PeerInfo> &holders, const std::string &name) {
+    // An earlier attempt broke off: fetch only what it did not store, from
+    // whichever holders there are now.
+    if (FetchJournal::exists(name)) return fetch_file_multi(holders, name) == 0 && check_fetched(name);
+    if (holders.size() > 1 && fetch_file_multi(holders, name) == 0 && check_fetched(name)) return true;
+    for (const PeerInfo &pi : holders) {
+        std::vector<bool> done;
+        if (fetch_files_pipelined(pi, {name}, done)) {
+            if (done[0] && check_fetched(name)) return true;
+            continue;
+        }
+        if (fetch_file_from_peer(pi, name) == 0 && check_fetched(name)) return true;
+    }
+    return false;
+}
+
+// --fetch-list: resolves every name in the list with batched SEARCHes, then
+// downloads them on jobs worker threads that each take the next name as they
+// finish one, and prints throughput and per-file latency. Returns the exit
+// status: 0 only if every name was fetched.
+int run_fetch_list(RegistryCluster &cluster, const std::string &path, int jobs) {
+    std::vector<std::string> names;
+    if (!read_name_list(path, names)) return 1;
+    std::vector<PeerInfo> holders;
+    if (!resolve_many(cluster, names, holders)) {
+        std::cerr << "Could not resolve " << path << ".\n";
+        return 1;
+    }
+
+    struct Result {
+        bool ok = false;
+        uint64_t bytes = 0;
+        double secs = 0;
+    };
+    std::vector<Result> results(names.size());
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        size_t k;
+        while ((k = next++) < names.size()) {
+            if (!holders[k].found) continue;
+            auto t0 = std::chrono::steady_clock::now();
+            results[k].ok = fetch_from_holders({holders[k]}, names[k]);
+            results[k].secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            struct stat st;
+            if (results[k].ok && stat(names[k].c_str(), &st) == 0) results[k].bytes = st.st_size;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs && static_cast<size_t>(j) < names.size(); ++j) workers.emplace_back(work);
+    for (auto &w : workers) w.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t fetched = 0, indexed = 0;
+    uint64_t bytes = 0;
+    std::vector<double> latency_ms;
+    for (size_t k = 0; k < names.size(); ++k) {
+        if (!holders[k].found) {
+            std::cout << names[k] << ": File not indexed by registry\n";
+            continue;
+        }
+        ++indexed;
+        if (!results[k].ok) {
+            std::cerr << "Could not fetch " << names[k] << " from peer " << holders[k].id << ".\n";
+            continue;
+        }
+        ++fetched;
+        bytes += results[k].bytes;
+        latency_ms.push_back(results[k].secs * 1000);
+    }
+
+    std::cout << "Fetched " << fetched << " of " << indexed << " indexed files, " << bytes
+              << " bytes in " << wall << " s (" << bytes / (wall + 1e-9) / (1 << 20) << " MB/s, "
+              << jobs << " at a time)\n";
+    if (!latency_ms.empty()) {
+        std::sort(latency_ms.begin(), latency_ms.end());
+        auto pct = [&](double p) { return latency_ms[static_cast<size_t>(p * (latency_ms.size() - 1))]; };
+        std::cout << "Per-file latency ms: min " << latency_ms.front() << ", p50 " << pct(0.50)
+                  << ", p90 " << pct(0.90) << ", p99 " << pct(0.99) << ", max " << latency_ms.back()
+                  << "\n";
+    }
+    return fetched == names.size() ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    bool clustered = false;
+    int search_ttl = DEFAULT_SEARCH_TTL;
+    size_t cache_entries = DEFAULT_SEARCH_CACHE;
+    size_t negative_entries = DEFAULT_NEGATIVE_CACHE;
+    std::string fetch_list;
+    int fetch_jobs = DEFAULT_FETCH_JOBS;
+    bool watch_shared = false;
+    bool usage_ok = argc >= 4;
+    for (int a = 4; usage_ok && a < argc; ++a) {
+        std::string flag = argv[a];
+        if (flag == "--cluster") {
+            clustered = true;
+        } else if ((flag == "--rcvbuf" || flag == "--sndbuf") && a + 1 < argc) {
+            int bytes = std::atoi(argv[++a]);
+            usage_ok = bytes > 0;
+            (flag == "--rcvbuf" ? transfer_rcvbuf : transfer_sndbuf) = bytes;
+        } else if (flag == "--search-ttl" && a + 1 < argc) {
+            search_ttl = std::atoi(argv[++a]);
+            usage_ok = search_ttl >= 0;
+        } else if ((flag == "--search-cache" || flag == "--negative-cache") && a + 1 < argc) {
+            long entries = std::atol(argv[++a]);
+            usage_ok = entries > 0;
+            (flag == "--search-cache" ? cache_entries : negative_entries) = entries;
+        } else if (flag == "--compress") {
+            fetch_compressed = true;
+        } else if (flag == "--watch") {
+            watch_shared = true;
+        } else if (flag == "--fetch-list" && a + 1 < argc) {
+            fetch_list = argv[++a];
+        } else if (flag == "-j" && a + 1 < argc) {
+            fetch_jobs = std::atoi(argv[++a]);
+            usage_ok = fetch_jobs > 0;
+        } else {
+            usage_ok = false;
+        }
+    }
+    if (!usage_ok) {
+        std::cerr << "Usage: " << argv[0] << " <registryHost> <registryPort> <peerID>"
+                  << " [--cluster] [--rcvbuf BYTES] [--sndbuf BYTES]"
+                  << " [--search-ttl SECS] [--search-cache N] [--negative-cache N] [--compress]"
+                  << " [--watch]"
+                  << " [--fetch-list FILE [-j N]]\n";
+        return 1;
+    }
+    search_cache.configure(cache_entries, negative_entries, std::chrono::seconds(search_ttl));
+
+    const char *host = argv[1];
+    const char *port = argv[2];
+    char *endp = nullptr;
+    unsigned long long id_ll = strtoull(argv[3], &endp, 10);
+    if (endp == argv[3] || *endp != '\0' || id_ll == 0 || id_ll > 0xFFFFFFFFULL) {
+        std::cerr << "Error: peerID must be a positive integer < 2^32.\n";
+        return 1;
+    }
+    uint32_t peer_id = static_cast<uint32_t>(id_ll);
+
+    int sock = lookup_and_connect(host, port, 0);
+    if (sock < 0) {
+        std::cerr << "Failed to connect to registry " << host << ":" << port << "\n";
+        return 1;
+    }
+
+    // With --cluster the registry given on the command line only supplies
+    // the member list; every name goes to the registry that owns it.
+    RegistryCluster cluster;
+    cluster.primary = sock;
+    cluster.peer_id = peer_id;
+    cluster.join_action = clustered ? ACTION_REGISTRY_JOIN : 0;
+    cluster.extended = clustered;
+    std::vector<std::string> members;
+    if (clustered && !fetch_cluster_map(sock, members)) {
+        std::cerr << "Could not get the cluster map from " << host << ":" << port << "\n";
+        return 1;
+    }
+    apply_cluster_map(cluster, members);
+
+    // Batch mode downloads and exits; there is nothing to serve.
+    if (!fetch_list.empty()) {
+        return run_fetch_list(cluster, fetch_list, fetch_jobs);
+    }
+
+    // Downloaders reach us on the port the registries see our connection from.
+    struct sockaddr_storage local{};
+    socklen_t local_len = sizeof(local);
+    std::unique_ptr<UploadServer> uploads;
+    if (getsockname(sock, reinterpret_cast<struct sockaddr *>(&local), &local_len) == 0) {
+        cluster.local_port = ntohs(local.ss_family == AF_INET6
+                                       ? reinterpret_cast<struct sockaddr_in6 *>(&local)->sin6_port
+                                       : reinterpret_cast<struct sockaddr_in *>(&local)->sin_port);
+        int listen_fd = UploadServer::listen_on(local.ss_family, cluster.local_port);
+        if (listen_fd >= 0) {
+            uploads.reset(new UploadServer(listen_fd));
+        } else {
+            std::perror("upload server");
+        }
+    }
+
+    PublishState publish_state;
+    // Only project 4 registries know HEARTBEAT (and drop idle peers).
+    std::unique_ptr<Heartbeat> heartbeat;
+    if (cluster.extended) heartbeat.reset(new Heartbeat(cluster));
+    std::unique_ptr<SharedWatcher> watcher;
+    // Commands run under command_mu; it is let go while waiting for input,
+    // which is when the watcher gets to publish.
+    std::unique_lock<std::mutex> busy(command_mu);
+    auto read_line = [&busy](std::string &line) {
+        busy.unlock();
+        bool ok = static_cast<bool>(std::getline(std::cin, line));
+        busy.lock();
+        return ok;
+    };
+    std::string cmd;
+    while (true) {
+        std::cout << "Enter a command: ";
+        if (!read_line(cmd)) {
+            break;
+        }
+
+        std::string up = cmd;
+        for (char &c : up) c = static_cast<char>(toupper((unsigned char)c));
+
+        if (up == "JOIN") {
+            cluster.joined = true;
+            for (size_t n = 0; n < cluster.socks.size(); ++n) {
+                if (cluster.socks[n] >= 0 && !do_join(cluster.socks[n], peer_id, cluster.join_action)) {
+                    std::cerr << "Failed to send JOIN request.\n";
+                }
+            }
+
+        } else if (up == "PUBLISH") {
+            // Watching starts before the listing, so nothing written in
+            // between is missed.
+            if (watch_shared && !watcher) watcher.reset(new SharedWatcher(cluster, clustered, publish_state));
+            if (!do_publish(cluster, clustered, publish_state)) {
+                std::cerr << "PUBLISH failed.\n";
+            } else {
+            }
+
+        } else if (up == "SEARCH") {
+            std::cout << "Enter a file name: ";
+            std::string fname;
+            if (!read_line(fname)) {
+                std::cerr << "No filename input. Returning to command prompt.\n";
+                continue;
+            }
+            // Cached under the same name as FETCH's answers, so it is asked
+            // for the same holder list and shows the first.
+            PeerInfo pi{0, "", 0, false};
+            std::vector<PeerInfo> holders;
+            bool from_cache;
+            if (!find_holders(cluster, fname, holders, from_cache)) continue;
+            if (!holders.empty()) pi = holders[0];
+            if (!pi.found) {
+                std::cout << "File not indexed by registry\n";
+            } else {
+                std::cout << "File found at\n";
+                std::cout << "Peer " << pi.id << "\n";
+                std::cout << pi.ip << ":" << pi.port << "\n";
+            }
+        } else if (up == "SEARCH-MANY") {
+            std::cout << "Enter a file listing names to search: ";
+            std::string list_path;
+            if (!read_line(list_path)) {
+                std::cerr << "No filename input. Returning to command prompt.\n";
+                continue;
+            }
+            std::vector<std::string> names;
+            if (!read_name_list(list_path, names)) continue;
+
+            std::vector<PeerInfo> results;
+            if (!resolve_many(cluster, names, results)) {
+                std::cerr << "SEARCH-MANY failed.\n";
+                continue;
+            }
+            for (size_t k = 0; k < names.size(); ++k) {
+                if (!results[k].found) {
+                    std::cout << names[k] << ": File not indexed by registry\n";
+                } else {
+                    std::cout << names[k] << ": Peer " << results[k].id << " "
+                              << results[k].ip << ":" << results[k].port << "\n";
+                }
+            }
+        } else if (up == "SEARCH-PATTERN") {
+            std::cout << "Enter a pattern (prefix* or *substring*): ";
+            std::string pattern;
+            if (!read_line(pattern)) {
+                std::cerr << "No pattern input. Returning to command prompt.\n";
+                continue;
+            }
+            bool substring = pattern.size() >= 2 && pattern.front() == '*' && pattern.back() == '*';
+            if (substring) {
+                pattern = pattern.substr(1, pattern.size() - 2);
+            } else if (!pattern.empty() && pattern.back() == '*') {
+                pattern.pop_back();
+            }
+
+            // Matches can live on any registry: ask them all and merge.
+            std::vector<std::pair<std::string, PeerInfo>> results;
+            bool ok = true;
+            for (size_t n = 0; n < cluster.addrs.size() && ok; ++n) {
+                std::vector<std::pair<std::string, PeerInfo>> part;
+                int fd = node_sock(cluster, n);
+                ok = fd >= 0 && search_pattern(fd, pattern, substring, part);
+                results.insert(results.end(), part.begin(), part.end());
+            }
+            if (!ok) {
+                std::cerr << "SEARCH-PATTERN failed.\n";
+                continue;
+            }
+            if (cluster.addrs.size() > 1) {
+                std::sort(results.begin(), results.end(),
+                          [](const std::pair<std::string, PeerInfo> &a,
+                             const std::pair<std::string, PeerInfo> &b) { return a.first < b.first; });
+                if (results.size() > PATTERN_LIMIT) results.resize(PATTERN_LIMIT);
+            }
+            if (results.empty()) {
+                std::cout << "No indexed file matches\n";
+            }
+            for (const auto &r : results) {
+                std::cout << r.first << ": Peer " << r.second.id << " "
+                          << r.second.ip << ":" << r.second.port << "\n";
+            }
+        } else if (up == "FETCH") {
             std::cout << "Enter a file name";
             std::string fname;
-            if (!std::getline(std::cin, fname)) {
+            if (!read_line(fname)) {
                 std::cerr << "No filename input.\n";
                 continue;
             }
-            PeerInfo pi = search_file(sock, fname);
-            fetch_file_from_peer(pi, fname);
+            std::vector<PeerInfo> holders;
+            bool from_cache = false;
+            bool fetched = false;
+            bool asked = find_holders(cluster, fname, holders, from_cache);
+            // Cached holders may have gone away: forget them and ask the registry.
+            while (asked && !holders.empty()) {
+                fetched = fetch_from_holders(holders, fname);
+                if (fetched || !from_cache) break;
+                search_cache.evict(fname);
+                asked = find_holders(cluster, fname, holders, from_cache);
+            }
+            if (!asked) continue;
+            if (holders.empty()) {
+                std::cout << "File not indexed by registry\n";
+                continue;
+            }
+            if (!fetched) {
+                search_cache.evict(fname);
+                std::cerr << "Could not fetch " << fname << " from any of "
+                          << holders.size() << " holders.\n";
+            }
+        } else if (up == "FETCH-MANY") {
+            std::cout << "Enter a file listing names to fetch: ";
+            std::string list_path;
+            if (!read_line(list_path)) {
+                std::cerr << "No filename input. Returning to command prompt.\n";
+                continue;
+            }
+            std::vector<std::string> names;
+            std::vector<PeerInfo> holders;
+            if (!read_name_list(list_path, names)) continue;
+            if (!resolve_many(cluster, names, holders)) {
+                std::cerr << "FETCH-MANY failed.\n";
+                continue;
+            }
+
+            // All names one holder has go down one pipelined connection,
+            // except those with a journal from a broken download: the
+            // pipeline starts files over, fetch_from_holders() resumes them.
+            std::map<std::string, std::vector<size_t>> by_holder;
+            size_t fetched = 0, wanted = 0;
+            for (size_t k = 0; k < names.size(); ++k) {
+                if (!holders[k].found) {
+                    std::cout << names[k] << ": File not indexed by registry\n";
+                    continue;
+                }
+                if (FetchJournal::exists(names[k])) {
+                    ++wanted;
+                    if (fetch_from_holders({holders[k]}, names[k])) {
+                        ++fetched;
+                    } else {
+                        std::cerr << "Could not fetch " << names[k] << " from peer " << holders[k].id << ".\n";
+                    }
+                    continue;
+                }
+                by_holder[holders[k].ip + ":" + std::to_string(holders[k].port)].push_back(k);
+            }
+            for (const auto &group : by_holder) {
+                const PeerInfo &pi = holders[group.second[0]];
+                std::vector<std::string> part;
+                for (size_t k : group.second) part.push_back(names[k]);
+                wanted += part.size();
+
+                std::vector<bool> done;
+                if (!fetch_files_pipelined(pi, part, done)) {
+                    done.assign(part.size(), false);
+                    for (size_t j = 0; j < part.size(); ++j) {
+                        done[j] = fetch_file_from_peer(pi, part[j]) == 0;
+                    }
+                }
+                for (size_t j = 0; j < part.size(); ++j) {
+                    if (done[j] && check_fetched(part[j])) {
+                        ++fetched;
+                    } else {
+                        std::cerr << "Could not fetch " << part[j] << " from peer " << pi.id << ".\n";
+                    }
+                }
+            }
+            std::cout << "Fetched " << fetched << " of " << wanted << " indexed files.\n";
+        } else if (up == "CACHE") {
+            search_cache.report(std::cout);
         } else if (up == "EXIT") {
+            busy.unlock();      // the watcher may be waiting to finish a delta
+            watcher.reset();
+            heartbeat.reset();
+            uploads.reset();
+            for (int fd : cluster.socks) {
+                if (fd >= 0 && fd != sock) close(fd);
+            }
             close(sock);
             break;
         } else {
-            std::cout << "Unknown command. Use JOIN, PUBLISH, SEARCH, EXIT.\n";
+            std::cout << "Unknown command. Use JOIN, PUBLISH, SEARCH, SEARCH-MANY, SEARCH-PATTERN, FETCH, FETCH-MANY, CACHE, EXIT.\n";
         }
     
 
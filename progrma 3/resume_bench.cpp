@@ -0,0 +1,229 @@
+/*
+ * resume_bench.cpp
+ *
+ * What the FETCH journal saves on a link that keeps dropping. A child
+ * process serves a scratch file from a requested offset (the way
+ * UploadServer answers FETCH_RANGE) and cuts each of the first FAILS
+ * connections after DROP_MB megabytes; later connections get the rest of
+ * the file. The parent downloads it with
+ *
+ *   restart  every attempt truncates the file and starts at offset 0
+ *   journal  attempts record what they stored in a FetchJournal and the
+ *            next one asks only for what is missing
+ *
+ * and reports the attempts, the bytes that crossed the socket, the bytes
+ * saved against restarting and the wall time (the journal's fdatasync()
+ * calls included). Both downloads are checked against the source.
+ *
+ * Usage: ./resume_bench [size_mb] [drop_mb] [fails]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fetch_recv.h"
+#include "fetch_journal.h"
+
+const char *SRC_PATH = "/tmp/resume_bench_src";
+const char *DST_PATH = "/tmp/resume_bench_dst";
+const uint64_t STEP = 4 << 20;      // FETCH_CHUNK in p2_reg.cpp
+
+// Serves SRC_PATH from the 8-byte big-endian offset each connection sends,
+// cutting the first fails connections after drop bytes.
+void serve(int listen_fd, off_t drop, int fails) {
+    for (int conn = 0;; ++conn) {
+        int c = accept(listen_fd, nullptr, nullptr);
+        if (c < 0) continue;
+        uint8_t req[8];
+        if (recv(c, req, sizeof(req), MSG_WAITALL) != sizeof(req)) {
+            close(c);
+            continue;
+        }
+        off_t off = 0;
+        for (uint8_t b : req) off = (off << 8) | b;
+        int f = open(SRC_PATH, O_RDONLY);
+        off_t end = lseek(f, 0, SEEK_END);
+        if (conn < fails) end = std::min(end, off + drop);
+        while (off < end) {
+            if (sendfile(c, f, &off, end - off) <= 0) break;
+        }
+        close(f);
+        close(c);
+    }
+}
+
+int connect_from(int port, uint64_t off) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t req[8];
+    for (int i = 7; i >= 0; --i, off >>= 8) req[i] = static_cast<uint8_t>(off);
+    send(fd, req, sizeof(req), 0);
+    return fd;
+}
+
+struct Result {
+    int attempts = 0;
+    uint64_t wire = 0;      // bytes received over all attempts
+    double secs = 0;
+};
+
+// One attempt of the journaled download, as receive_journaled() in
+// p2_reg.cpp does it: stored steps are recorded, and on a drop the
+// partial step too before the journal is flushed.
+bool journaled_attempt(int port, uint64_t size, Result &res) {
+    FetchJournal journal(DST_PATH, size);
+    bool resumed = journal.load();
+    int fd = open(DST_PATH, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    if (fd < 0 || !journal.start(fd, resumed)) return false;
+    uint64_t off = journal.missing().empty() ? size : journal.missing().front().first;
+    int sock = connect_from(port, off);
+    bool ok = sock >= 0;
+    lseek(fd, off, SEEK_SET);
+    while (ok && off < size) {
+        uint64_t step = std::min(STEP, size - off);
+        if (receive_to_file(sock, fd, step) != (long long)step) {
+            off_t at = lseek(fd, 0, SEEK_CUR);
+            if (at > (off_t)off) {
+                journal.record(off, at - off);
+                res.wire += at - off;
+            }
+            ok = false;
+            break;
+        }
+        journal.record(off, step);
+        res.wire += step;
+        off += step;
+    }
+    if (sock >= 0) close(sock);
+    if (ok) {
+        journal.finish();
+    } else {
+        journal.flush();
+    }
+    close(fd);
+    return ok;
+}
+
+bool restart_attempt(int port, uint64_t size, Result &res) {
+    int fd = open(DST_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int sock = connect_from(port, 0);
+    if (fd < 0 || sock < 0) return false;
+    long long got = receive_to_file(sock, fd, size);
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    res.wire += at > 0 ? at : 0;
+    close(sock);
+    close(fd);
+    return got == (long long)size;
+}
+
+bool same_as_source(uint64_t size) {
+    FILE *a = fopen(SRC_PATH, "rb"), *b = fopen(DST_PATH, "rb");
+    bool same = a != nullptr && b != nullptr;
+    std::vector<char> x(1 << 20), y(1 << 20);
+    for (uint64_t done = 0; same && done < size;) {
+        size_t n = fread(x.data(), 1, x.size(), a);
+        same = n > 0 && fread(y.data(), 1, n, b) == n && std::memcmp(x.data(), y.data(), n) == 0;
+        done += n;
+    }
+    if (a != nullptr) fclose(a);
+    if (b != nullptr) fclose(b);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    long long size_mb = argc > 1 ? std::atoll(argv[1]) : 256;
+    long long drop_mb = argc > 2 ? std::atoll(argv[2]) : 48;
+    int fails = argc > 3 ? std::atoi(argv[3]) : 4;
+    uint64_t size = size_mb << 20;
+
+    {
+        int f = open(SRC_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        std::vector<uint8_t> block(1 << 20);
+        for (long long m = 0; m < size_mb; ++m) {
+            for (size_t i = 0; i < block.size(); ++i) block[i] = static_cast<uint8_t>(i * 131 + m * 7);
+            if (!write_all_fd(f, block.data(), block.size())) {
+                std::perror("write");
+                return 1;
+            }
+        }
+        close(f);
+    }
+
+    std::cout << size_mb << " MB over loopback, first " << fails << " connections cut after "
+              << drop_mb << " MB\n"
+              << std::left << std::setw(8) << "method" << std::right << std::setw(10) << "attempts"
+              << std::setw(12) << "MB on wire" << std::setw(10) << "MB saved" << std::setw(10) << "s"
+              << "\n";
+
+    int failed = 0;
+    uint64_t restart_wire = 0;
+    for (const char *method : {"restart", "journal"}) {
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0
+            || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+            std::perror("listen");
+            return 1;
+        }
+        int port = ntohs(addr.sin_port);
+        pid_t server = fork();
+        if (server == 0) {
+            serve(listen_fd, drop_mb << 20, fails);
+            _exit(0);
+        }
+        close(listen_fd);
+
+        unlink(DST_PATH);
+        unlink((std::string(DST_PATH) + ".journal").c_str());
+        bool journaled = std::strcmp(method, "journal") == 0;
+        Result res;
+        auto t0 = std::chrono::steady_clock::now();
+        bool done = false;
+        while (!done && res.attempts <= fails) {
+            ++res.attempts;
+            done = journaled ? journaled_attempt(port, size, res) : restart_attempt(port, size, res);
+        }
+        res.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+
+        if (!done || !same_as_source(size)) {
+            std::cerr << method << ": download " << (done ? "differs from the source" : "did not complete")
+                      << "\n";
+            ++failed;
+        }
+        if (!journaled) restart_wire = res.wire;
+        double saved = journaled ? (double(restart_wire) - double(res.wire)) / (1 << 20) : 0;
+        std::cout << std::left << std::setw(8) << method << std::right << std::setw(10) << res.attempts
+                  << std::fixed << std::setprecision(0) << std::setw(12) << res.wire / double(1 << 20)
+                  << std::setw(10) << saved << std::setprecision(3) << std::setw(10) << res.secs << "\n";
+    }
+
+    unlink(SRC_PATH);
+    unlink(DST_PATH);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/*
+ * backend_bench.cpp
+ *
+ * Runs ./registry once per backend (poll, epoll, io_uring) and drives it
+ * with CLIENTS connections over loopback. Each client JOINs and publishes
+ * FILES_PER_CLIENT names; then, for ROUNDS rounds, every client sends one
+ * SEARCH and the bench collects all the replies before the next round, so
+ * CLIENTS requests are always in flight together. Reports SEARCH latency
+ * (p50/p99, send to reply) and the I/O syscalls per request the registry
+ * counted, taken from the line it prints on SIGTERM.
+ *
+ * Usage: ./backend_bench [port]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+const int CLIENTS = 32;
+const int FILES_PER_CLIENT = 100;
+const int ROUNDS = 2000;
+const size_t NAME_LEN = 100;
+const size_t SEARCH_REPLY_LEN = 12;
+
+using Clock = std::chrono::steady_clock;
+
+bool send_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, 0);
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, char* buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = recv(fd, buf + off, len - off, 0);
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+std::string name_field(const std::string& name) {
+    std::string field(NAME_LEN, '\0');
+    field.replace(0, name.size(), name);
+    return field;
+}
+
+std::string file_name(int client, int k) {
+    return "client" + std::to_string(client) + "_file" + std::to_string(k) + ".dat";
+}
+
+int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int tries = 0; tries < 100; ++tries) {
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        usleep(20000);
+    }
+    close(fd);
+    return -1;
+}
+
+// Starts the registry with stderr on a pipe; trace lines go to /dev/null.
+pid_t start_registry(int port, const std::string& backend, int& err_fd) {
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        std::string port_str = std::to_string(port);
+        execl("./registry", "./registry", port_str.c_str(), "--backend", backend.c_str(),
+              (char*)nullptr);
+        _exit(127);
+    }
+    close(fds[1]);
+    err_fd = fds[0];
+    return pid;
+}
+
+std::string read_all(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) out.append(buf, n);
+    return out;
+}
+
+double percentile(std::vector<double>& v, double p) {
+    size_t k = static_cast<size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// Returns false if the registry could not be driven.
+bool run_backend(int port, const std::string& backend) {
+    int err_fd = -1;
+    pid_t pid = start_registry(port, backend, err_fd);
+    if (pid < 0) return false;
+
+    std::vector<int> socks;
+    for (int c = 0; c < CLIENTS; ++c) {
+        int fd = connect_to(port);
+        if (fd < 0) break;
+        socks.push_back(fd);
+
+        std::string msg(1, '\x01');
+        uint32_t id = htonl(c + 1);
+        msg.append(reinterpret_cast<const char*>(&id), 4);
+        msg += '\x02';
+        uint32_t count = htonl(FILES_PER_CLIENT);
+        msg.append(reinterpret_cast<const char*>(&count), 4);
+        for (int k = 0; k < FILES_PER_CLIENT; ++k) msg += name_field(file_name(c, k));
+        send_all(fd, msg);
+    }
+
+    bool ok = socks.size() == static_cast<size_t>(CLIENTS);
+    std::vector<double> latency_us;
+    latency_us.reserve((size_t)ROUNDS * CLIENTS);
+    auto start = Clock::now();
+    for (int r = 0; ok && r < ROUNDS; ++r) {
+        std::vector<Clock::time_point> sent(CLIENTS);
+        for (int c = 0; c < CLIENTS; ++c) {
+            // Every fourth query misses.
+            int owner = (c + r) % CLIENTS;
+            std::string target = r % 4 == 3 ? "missing.dat" : file_name(owner, r % FILES_PER_CLIENT);
+            sent[c] = Clock::now();
+            ok = ok && send_all(socks[c], '\x03' + name_field(target));
+        }
+        for (int c = 0; ok && c < CLIENTS; ++c) {
+            char reply[SEARCH_REPLY_LEN];
+            ok = recv_all(socks[c], reply, sizeof(reply));
+            latency_us.push_back(std::chrono::duration<double, std::micro>(
+                Clock::now() - sent[c]).count());
+        }
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (int fd : socks) close(fd);
+    kill(pid, SIGTERM);
+    std::string err = read_all(err_fd);
+    close(err_fd);
+    waitpid(pid, nullptr, 0);
+
+    if (!ok) {
+        std::cerr << backend << ": client I/O failed" << std::endl;
+        return false;
+    }
+
+    // "Served N requests with M I/O syscalls (...)"
+    double per_request = -1;
+    size_t at = err.find("Served ");
+    if (at != std::string::npos) {
+        unsigned long long requests = 0, syscalls = 0;
+        if (std::sscanf(err.c_str() + at, "Served %llu requests with %llu", &requests, &syscalls) == 2
+            && requests > 0) {
+            per_request = double(syscalls) / requests;
+        }
+    }
+    if (err.find("Falling back") != std::string::npos) {
+        std::cerr << backend << ": not available here, ran on epoll" << std::endl;
+    }
+
+    std::cout << std::left << std::setw(10) << backend << std::right << std::fixed
+              << std::setprecision(1)
+              << std::setw(12) << latency_us.size() / secs
+              << std::setw(10) << percentile(latency_us, 0.50)
+              << std::setw(10) << percentile(latency_us, 0.99)
+              << std::setprecision(2) << std::setw(14) << per_request << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? std::atoi(argv[1]) : 5460;
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << CLIENTS << " clients, " << ROUNDS << " rounds of one SEARCH each" << std::endl;
+    std::cout << std::left << std::setw(10) << "backend" << std::right
+              << std::setw(12) << "req/s" << std::setw(10) << "p50 us"
+              << std::setw(10) << "p99 us" << std::setw(14) << "syscalls/req" << std::endl;
+    int failed = 0;
+    for (const char* backend : {"poll", "epoll", "io_uring"}) {
+        // A fresh port per run, so TIME_WAIT from the last one does not matter.
+        if (!run_backend(port++, backend)) ++failed;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,120 @@
+/*
+ * bloom_filter.h
+ *
+ * Bloom filter of every name the registry has interned, exported to peers
+ * through FETCH_FILTER so they can answer "definitely not indexed" SEARCHes
+ * without a round trip.
+ *
+ * The registry side keeps an 8-bit counter per bit so names can be removed
+ * again; a counter that reaches 255 sticks there, which only costs a false
+ * positive. Peers get the plain bitmap: bit b is set while counter b is
+ * non-zero.
+ *
+ * Each time a bitmap bit flips the generation goes up by one and the word
+ * holding that bit is logged. A peer that asks with a generation still
+ * covered by the log gets only the words that changed since; otherwise it
+ * gets the whole bitmap. The epoch is drawn at startup, so a peer's cache
+ * from before a registry restart is never mistaken for a current one.
+ *
+ * Bit positions come from ring_hash() by double hashing and are part of the
+ * protocol: progrma 3/p2_reg.cpp computes them the same way.
+ */
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <vector>
+#include <deque>
+#include <string_view>
+#include <mutex>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+
+#include "hash_ring.h"
+
+const uint32_t BLOOM_BITS = 1u << 20;      // 128 KB bitmap
+const int BLOOM_HASHES = 4;
+
+// Calls f(bit) for each of the name's BLOOM_HASHES bit positions.
+template <typename F>
+void bloom_bits(std::string_view name, F f) {
+    uint64_t h = ring_hash(name);
+    uint32_t h1 = static_cast<uint32_t>(h);
+    uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; ++i) {
+        f((h1 + i * h2) & (BLOOM_BITS - 1));
+    }
+}
+
+class CountingBloom {
+public:
+    static const size_t WORDS = BLOOM_BITS / 64;
+
+    CountingBloom() : counters(BLOOM_BITS, 0), words(WORDS, 0) {
+        std::random_device rd;
+        epoch_id = rd();
+    }
+
+    void add(std::string_view name) {
+        std::lock_guard<std::mutex> lock(mu);
+        bloom_bits(name, [&](uint32_t b) {
+            if (counters[b] == 255) return;
+            if (counters[b]++ == 0) flip(b);
+        });
+    }
+
+    void remove(std::string_view name) {
+        std::lock_guard<std::mutex> lock(mu);
+        bloom_bits(name, [&](uint32_t b) {
+            if (counters[b] == 255 || counters[b] == 0) return;
+            if (--counters[b] == 0) flip(b);
+        });
+    }
+
+    uint32_t epoch() const { return epoch_id; }
+
+    // What a peer holding (peer_epoch, peer_gen) needs to catch up.
+    // Returns false if the whole bitmap must be sent; changed is then left
+    // empty and full is the bitmap. Otherwise changed lists (word index,
+    // word) pairs and is empty when the peer is current. gen is always set.
+    bool delta(uint32_t peer_epoch, uint32_t peer_gen, uint32_t& gen,
+               std::vector<std::pair<uint32_t, uint64_t>>& changed,
+               std::vector<uint64_t>& full) const {
+        std::lock_guard<std::mutex> lock(mu);
+        gen = generation;
+        changed.clear();
+        uint32_t behind = generation - peer_gen;
+        if (peer_epoch != epoch_id || behind > log.size() || behind > MAX_DELTA_WORDS) {
+            full = words;
+            return false;
+        }
+
+        std::vector<uint32_t> idx(log.end() - behind, log.end());
+        std::sort(idx.begin(), idx.end());
+        idx.erase(std::unique(idx.begin(), idx.end()), idx.end());
+        for (uint32_t w : idx) changed.emplace_back(w, words[w]);
+        return true;
+    }
+
+private:
+    // A delta is only worth it while it is well under the full bitmap.
+    static const size_t MAX_DELTA_WORDS = WORDS / 8;
+    static const size_t LOG_LIMIT = MAX_DELTA_WORDS;
+
+    void flip(uint32_t b) {
+        words[b / 64] ^= uint64_t(1) << (b % 64);
+        ++generation;
+        log.push_back(b / 64);
+        if (log.size() > LOG_LIMIT) log.pop_front();
+    }
+
+    mutable std::mutex mu;
+    std::vector<uint8_t> counters;
+    std::vector<uint64_t> words;
+    std::deque<uint32_t> log;           // word changed by each recent generation
+    uint32_t generation = 0;
+    uint32_t epoch_id = 0;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * cluster_bench.cpp
+ *
+ * How evenly the consistent-hash ring spreads filenames over a cluster and
+ * how many of them change owner when one more registry joins. Ideally each
+ * of N nodes owns 1/N of the names and growing to N + 1 nodes moves
+ * 1/(N + 1) of them, all onto the new node.
+ *
+ * Usage: ./cluster_bench [names]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+
+#include "hash_ring.h"
+
+std::vector<std::string> members(size_t n) {
+    std::vector<std::string> out;
+    for (size_t i = 0; i < n; ++i) {
+        out.push_back("127.0.0.1:" + std::to_string(5000 + i));
+    }
+    return out;
+}
+
+int main(int argc, char* argv[]) {
+    size_t names = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    if (names == 0) names = 1;
+    std::vector<std::string> files;
+    files.reserve(names);
+    for (size_t i = 0; i < names; ++i) {
+        files.push_back("shared/file_" + std::to_string(i) + ".dat");
+    }
+
+    std::cout << names << " names, " << HashRing::VNODES << " points per node" << std::endl;
+    std::cout << "nodes  max/avg load  moved on +1 node  ideal" << std::endl;
+    for (size_t n = 1; n <= 8; ++n) {
+        HashRing before, after;
+        before.set_nodes(members(n));
+        after.set_nodes(members(n + 1));
+
+        std::vector<size_t> load(n, 0);
+        size_t moved = 0, moved_elsewhere = 0;
+        for (const std::string& f : files) {
+            size_t a = before.owner(f);
+            size_t b = after.owner(f);
+            ++load[a];
+            if (a != b) {
+                ++moved;
+                if (b != n) ++moved_elsewhere;      // should never happen
+            }
+        }
+
+        double avg = double(names) / n;
+        double max = double(*std::max_element(load.begin(), load.end()));
+        std::cout << std::setw(5) << n << "  " << std::fixed << std::setprecision(3)
+                  << std::setw(12) << max / avg << "  "
+                  << std::setw(16) << double(moved) / names << "  "
+                  << std::setw(5) << 1.0 / (n + 1);
+        if (moved_elsewhere > 0) {
+            std::cout << "  (" << moved_elsewhere << " moved between old nodes)";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * conn_table.h
+ *
+ * Per-connection state for the registry and the table that owns it.
+ *
+ * Each PeerInfo is heap allocated so its address never changes; the epoll
+ * backend stores that pointer in epoll_event.data. The table itself is a
+ * dense vector of those pointers, and every PeerInfo remembers its slot so
+ * a disconnect is an O(1) swap with the last entry instead of an erase
+ * that shifts everything behind it.
+ */
+
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <unordered_set>
+#include <memory>
+#include <cstdint>
+#include <netinet/in.h>
+
+#include "msg_parser.h"
+#include "file_index.h"
+#include "timer_wheel.h"
+
+struct PeerInfo {
+    int socket_fd;
+    uint64_t key;           // unique per connection, increases in accept() order
+    uint32_t id;
+    struct sockaddr_in addr;
+    std::unordered_set<NameId> files;   // interned in the registry's FileIndex
+    bool has_joined;
+    size_t slot;            // position in ConnTable, maintained by the table
+
+    RecvBuffer rx;
+    FrameParser parser;
+    std::string tx;         // replies the socket would not take yet
+
+    uint64_t last_active = 0;   // tick of the last byte received
+    TimerNode idle_timer;       // owner points back here
+
+    // io_uring backend only. Replies move from tx into out, one segment per
+    // batch of completions, and stay there until the kernel has sent them:
+    // in-flight SENDs point into those strings.
+    bool defer_send = false;    // send_reply_vec appends to tx instead of writev()
+    std::deque<std::string> out;
+    size_t out_sent = 0;        // bytes of out.front() already sent
+    unsigned sends_inflight = 0;
+    bool recv_armed = false;
+    bool closing = false;
+    bool touched = false;       // already queued for the end-of-batch pass
+};
+
+class ConnTable {
+public:
+    PeerInfo* add(std::unique_ptr<PeerInfo> p) {
+        p->slot = conns.size();
+        conns.push_back(std::move(p));
+        return conns.back().get();
+    }
+
+    // Moves the last connection into p's slot. Callers walking the table by
+    // index must revisit the same slot after a remove.
+    void remove(PeerInfo* p) {
+        size_t slot = p->slot;
+        if (slot != conns.size() - 1) {
+            conns[slot] = std::move(conns.back());
+            conns[slot]->slot = slot;
+        }
+        conns.pop_back();
+    }
+
+    PeerInfo* at(size_t slot) const { return conns[slot].get(); }
+    size_t size() const { return conns.size(); }
+
+private:
+    std::vector<std::unique_ptr<PeerInfo>> conns;
+};
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * file_index.h
+ *
+ * Filename -> holder index for the registry. PUBLISH adds the publishing
+ * connection under each name, disconnect removes it again, so SEARCH is a
+ * single hash probe instead of a walk over every peer's file list.
+ *
+ * Holders of a name are kept sorted by connection key. Keys are handed out
+ * in accept() order, so the first holder is the same peer the old linear
+ * scan over the peers vector would have returned.
+ *
+ * The index is shared by every event loop in --threads mode. Names are
+ * spread over SHARDS independently locked maps: SEARCH takes a shard's lock
+ * shared, PUBLISH and disconnect take it exclusively, so lookups only wait
+ * on writers that touch the same shard. Results are returned by value
+ * because a holder may be removed as soon as the lock is released.
+ *
+ * Names are interned: each distinct name is stored once, in its shard's
+ * StringArena, and peers keep only the 32-bit NameId that intern() returns.
+ * A name is reference counted by the peers that published it and its arena
+ * bytes are reclaimed by compaction once enough of them are dead.
+ *
+ * Every live name is also in a PatternIndex for prefix/substring queries
+ * and in the CountingBloom peers fetch to skip definite misses. Content
+ * hash keys (HASH_KEY_PREFIX and 32 hex digits) are indexed like names but
+ * left out of the PatternIndex, so pattern queries only see filenames.
+ * Lock order is shard, then pattern index or filter; pattern queries release
+ * the pattern lock before resolving holders, so the two never wait on each
+ * other.
+ */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+
+#include "pattern_index.h"
+#include "bloom_filter.h"
+
+struct Holder {
+    uint64_t key;           // connection that published the name
+    uint32_t peer_id;       // host byte order
+    struct sockaddr_in addr;
+};
+
+// Starts the key a content hash is filed under; see PUBLISH_HASHED.
+const char HASH_KEY_PREFIX = '#';
+
+// NameId (pattern_index.h): low bits select the shard, the rest is the
+// slot inside it.
+
+struct PatternMatch {
+    std::string name;
+    Holder holder;              // first holder, as plain SEARCH would return
+};
+
+// Bump allocator for name bytes. Strings are never freed one by one; the
+// owner copies the live ones into a fresh arena and drops the old one.
+class StringArena {
+public:
+    std::string_view store(std::string_view s) {
+        if (chunks.empty() || used + s.size() > chunk_size) {
+            chunk_size = std::max(CHUNK, s.size());
+            chunks.emplace_back(new char[chunk_size]);
+            used = 0;
+        }
+        char* dst = chunks.back().get() + used;
+        std::memcpy(dst, s.data(), s.size());
+        used += s.size();
+        return std::string_view(dst, s.size());
+    }
+
+private:
+    static const size_t CHUNK = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_size = 0;
+    size_t used = 0;
+};
+
+class FileIndex {
+public:
+    static const size_t SHARDS = 64;
+
+    // Returns the id for name, creating it if needed, and takes refs references.
+    NameId intern(std::string_view name, uint32_t refs = 1) {
+        size_t sh = shard_of(name);
+        Shard& s = shards[sh];
+        std::unique_lock<std::shared_mutex> lock(s.mu);
+
+        auto found = s.by_name.find(name);
+        if (found != s.by_name.end()) {
+            s.slots[found->second].refs += refs;
+            return make_id(sh, found->second);
+        }
+
+        uint32_t slot;
+        if (!s.free_slots.empty()) {
+            slot = s.free_slots.back();
+            s.free_slots.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(s.slots.size());
+            s.slots.emplace_back();
+        }
+        Slot& e = s.slots[slot];
+        e.name = s.arena.store(name);
+        e.refs = refs;
+        s.live_bytes += name.size();
+        s.by_name.emplace(e.name, slot);
+        if (!is_hash_key(e.name)) patterns.insert(e.name, make_id(sh, slot));
+        bloom.add(e.name);
+        return make_id(sh, slot);
+    }
+
+    // Drops every reference a disconnecting peer held, removing it as a
+    // holder on the way. Ids are grouped by shard so each lock is taken once.
+    void release_all(std::vector<NameId> ids, uint64_t key) {
+        std::sort(ids.begin(), ids.end(), [](NameId a, NameId b) {
+            return shard_part(a) < shard_part(b);
+        });
+        size_t k = 0;
+        while (k < ids.size()) {
+            Shard& s = shards[shard_part(ids[k])];
+            std::unique_lock<std::shared_mutex> lock(s.mu);
+            size_t sh = shard_part(ids[k]);
+            for (; k < ids.size() && shard_part(ids[k]) == sh; ++k) {
+                Slot& e = s.slots[slot_part(ids[k])];
+                remove_holder(e, key);
+                if (--e.refs == 0) free_slot(s, sh, slot_part(ids[k]));
+            }
+            maybe_compact(s);
+        }
+    }
+
+    // Looks up an existing name without taking a reference.
+    bool find_id(std::string_view name, NameId& out) const {
+        size_t sh = shard_of(name);
+        const Shard& s = shards[sh];
+        std::shared_lock<std::shared_mutex> lock(s.mu);
+
+        auto found = s.by_name.find(name);
+        if (found == s.by_name.end()) return false;
+        out = make_id(sh, found->second);
+        return true;
+    }
+
+    // Drops one peer's reference to a name and its holder entry, for a
+    // PUBLISH_REMOVE.
+    void release(NameId id, uint64_t key) {
+        size_t sh = shard_part(id);
+        Shard& s = shards[sh];
+        std::unique_lock<std::shared_mutex> lock(s.mu);
+        Slot& e = s.slots[slot_part(id)];
+        remove_holder(e, key);
+        if (--e.refs == 0) free_slot(s, sh, slot_part(id));
+        maybe_compact(s);
+    }
+
+    // Returns false if this connection already holds the name.
+    bool add(NameId id, const Holder& h) {
+        Shard& s = shards[shard_part(id)];
+        std::unique_lock<std::shared_mutex> lock(s.mu);
+
+        std::vector<Holder>& holders = s.slots[slot_part(id)].holders;
+        auto it = std::lower_bound(holders.begin(), holders.end(), h.key, key_less);
+        if (it != holders.end() && it->key == h.key) {
+            return false;
+        }
+        holders.insert(it, h);
+        entries.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void remove(NameId id, uint64_t key) {
+        Shard& s = shards[shard_part(id)];
+        std::unique_lock<std::shared_mutex> lock(s.mu);
+        remove_holder(s.slots[slot_part(id)], key);
+    }
+
+    // Copies the first holder of the name into out. False if nobody has it.
+    bool find_first(std::string_view name, Holder& out) const {
+        const Shard& s = shards[shard_of(name)];
+        std::shared_lock<std::shared_mutex> lock(s.mu);
+
+        auto found = s.by_name.find(name);
+        if (found == s.by_name.end()) return false;
+        const std::vector<Holder>& holders = s.slots[found->second].holders;
+        if (holders.empty()) return false;
+        out = holders.front();
+        return true;
+    }
+
+    // Copies up to max holders of the name, starting at start % holders and
+    // wrapping around, so successive callers with a moving start see
+    // different slices of a popular name's holder list.
+    std::vector<Holder> find_some(std::string_view name, size_t start, size_t max) const {
+        std::vector<Holder> out;
+        const Shard& s = shards[shard_of(name)];
+        std::shared_lock<std::shared_mutex> lock(s.mu);
+
+        auto found = s.by_name.find(name);
+        if (found == s.by_name.end()) return out;
+        const std::vector<Holder>& holders = s.slots[found->second].holders;
+        size_t n = std::min(max, holders.size());
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            out.push_back(holders[(start + i) % holders.size()]);
+        }
+        return out;
+    }
+
+    // Names matching a prefix (or, if prefix is false, containing pattern)
+    // that someone currently holds, at most limit of them.
+    std::vector<PatternMatch> find_pattern(bool prefix, std::string_view pattern, size_t limit) const {
+        std::vector<PatternMatch> out;
+        // Ask for a few extra: names published only by peers that have not
+        // JOINed yet are interned but have no holder to return.
+        size_t want = limit + limit / 2 + 8;
+        auto candidates = prefix ? patterns.find_prefix(pattern, want)
+                                 : patterns.find_substring(pattern, want);
+
+        for (const auto& c : candidates) {
+            if (out.size() >= limit) break;
+            const Shard& s = shards[shard_part(c.first)];
+            std::shared_lock<std::shared_mutex> lock(s.mu);
+
+            uint32_t slot = slot_part(c.first);
+            if (slot >= s.slots.size()) continue;
+            const Slot& e = s.slots[slot];
+            // The id may have been freed and reused since the pattern lock was dropped.
+            if (e.refs == 0 || e.holders.empty() || e.name != c.second) continue;
+            out.push_back(PatternMatch{c.second, e.holders.front()});
+        }
+        return out;
+    }
+
+    // Calls f(name, holders) for every name that has at least one holder.
+    // Shards are visited one at a time under a shared lock, so the walk is
+    // consistent per shard but not across the whole index.
+    template <typename F>
+    void for_each_name(F f) const {
+        for (const Shard& s : shards) {
+            std::shared_lock<std::shared_mutex> lock(s.mu);
+            for (const Slot& e : s.slots) {
+                if (e.refs > 0 && !e.holders.empty()) f(e.name, e.holders);
+            }
+        }
+    }
+
+    size_t size() const { return entries.load(std::memory_order_relaxed); }
+
+    const CountingBloom& filter() const { return bloom; }
+
+private:
+    struct Slot {
+        std::string_view name;      // points into the shard's arena
+        std::vector<Holder> holders;
+        uint32_t refs = 0;          // peers that published the name
+    };
+
+    struct Shard {
+        mutable std::shared_mutex mu;
+        std::unordered_map<std::string_view, uint32_t> by_name;
+        std::vector<Slot> slots;
+        std::vector<uint32_t> free_slots;
+        StringArena arena;
+        size_t live_bytes = 0;
+        size_t dead_bytes = 0;
+    };
+
+    static const int SHARD_BITS = 6;
+
+    static size_t shard_of(std::string_view name) {
+        return std::hash<std::string_view>()(name) % SHARDS;
+    }
+    static NameId make_id(size_t shard, uint32_t slot) {
+        return (slot << SHARD_BITS) | static_cast<NameId>(shard);
+    }
+    static size_t shard_part(NameId id) { return id & (SHARDS - 1); }
+    static uint32_t slot_part(NameId id) { return id >> SHARD_BITS; }
+
+    static bool key_less(const Holder& h, uint64_t key) { return h.key < key; }
+
+    static bool is_hash_key(std::string_view name) {
+        return !name.empty() && name[0] == HASH_KEY_PREFIX;
+    }
+
+    void remove_holder(Slot& e, uint64_t key) {
+        auto it = std::lower_bound(e.holders.begin(), e.holders.end(), key, key_less);
+        if (it == e.holders.end() || it->key != key) return;
+        e.holders.erase(it);
+        entries.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void free_slot(Shard& s, size_t shard, uint32_t slot) {
+        Slot& e = s.slots[slot];
+        if (!is_hash_key(e.name)) patterns.erase(e.name, make_id(shard, slot));
+        bloom.remove(e.name);
+        s.by_name.erase(e.name);
+        s.live_bytes -= e.name.size();
+        s.dead_bytes += e.name.size();
+        e = Slot();
+        s.free_slots.push_back(slot);
+    }
+
+    // Rebuilds the arena from the live names once more than half of it is
+    // garbage. Slots do not move, so ids held by peers stay valid.
+    static void maybe_compact(Shard& s) {
+        if (s.dead_bytes < 64 * 1024 || s.dead_bytes < s.live_bytes) return;
+
+        StringArena fresh;
+        s.by_name.clear();
+        for (uint32_t slot = 0; slot < s.slots.size(); ++slot) {
+            Slot& e = s.slots[slot];
+            if (e.refs == 0) continue;
+            e.name = fresh.store(e.name);
+            s.by_name.emplace(e.name, slot);
+        }
+        s.arena = std::move(fresh);
+        s.dead_bytes = 0;
+    }
+
+    Shard shards[SHARDS];
+    PatternIndex patterns;
+    CountingBloom bloom;
+    std::atomic<size_t> entries{0};
+};
+
+#endif
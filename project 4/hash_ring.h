@@ -0,0 +1,73 @@
+/*
+ * hash_ring.h
+ *
+ * Consistent hashing of filenames onto the registries of a cluster.
+ *
+ * Every node ("a.b.c.d:port") is placed on a 64-bit ring at VNODES points;
+ * a name belongs to the node owning the first point at or after the name's
+ * hash, wrapping around. Adding a node therefore only takes over the arcs
+ * in front of its own points, about 1/N of the names, and leaves every
+ * other name where it was.
+ *
+ * Peers compute the same ring from the CLUSTER_MAP reply, so the hash and
+ * point layout here are part of the protocol: progrma 3/p2_reg.cpp carries
+ * a copy that must stay identical.
+ */
+
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// FNV-1a, then the splitmix64 finalizer so short, similar names still
+// spread over the whole ring.
+inline uint64_t ring_hash(std::string_view s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+class HashRing {
+public:
+    static const int VNODES = 160;
+
+    void set_nodes(const std::vector<std::string>& addrs) {
+        nodes = addrs;
+        points.clear();
+        for (uint32_t n = 0; n < nodes.size(); ++n) {
+            for (int v = 0; v < VNODES; ++v) {
+                points.emplace_back(ring_hash(nodes[n] + "#" + std::to_string(v)), n);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    // Index into the node list; the ring must not be empty.
+    size_t owner(std::string_view name) const {
+        uint64_t h = ring_hash(name);
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(h, uint32_t(0)));
+        if (it == points.end()) it = points.begin();
+        return it->second;
+    }
+
+    size_t size() const { return nodes.size(); }
+    const std::string& node(size_t i) const { return nodes[i]; }
+
+private:
+    std::vector<std::string> nodes;
+    std::vector<std::pair<uint64_t, uint32_t>> points;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * load_tracker.h
+ *
+ * Remembers how often the registry has recently handed each connection out
+ * as a download source, so SEARCH_MULTI can steer fetches away from peers
+ * that every other client was just sent to.
+ *
+ * Load is a count of times returned that halves every HALF_LIFE seconds.
+ * Candidates are ordered by current load, then by how long ago they were
+ * last returned, so equally loaded holders take turns.
+ */
+
+#ifndef LOAD_TRACKER_H
+#define LOAD_TRACKER_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+
+#include "file_index.h"
+
+class LoadTracker {
+public:
+    static constexpr double HALF_LIFE = 60.0;
+
+    // Reorders holders so the k least loaded come first, drops the rest,
+    // and charges one unit of load to each of the k returned.
+    void pick(std::vector<Holder>& holders, size_t k) {
+        double now = seconds_now();
+
+        struct Ranked {
+            double load;
+            double last;
+            size_t pos;
+        };
+        std::vector<Ranked> ranked;
+        ranked.reserve(holders.size());
+        for (size_t i = 0; i < holders.size(); ++i) {
+            Shard& s = shard_for(holders[i].key);
+            std::lock_guard<std::mutex> lock(s.mu);
+            auto found = s.by_key.find(holders[i].key);
+            if (found == s.by_key.end()) {
+                ranked.push_back(Ranked{0.0, 0.0, i});
+            } else {
+                ranked.push_back(Ranked{decayed(found->second, now), found->second.last, i});
+            }
+        }
+
+        k = std::min(k, holders.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(),
+                          [](const Ranked& a, const Ranked& b) {
+            if (a.load != b.load) return a.load < b.load;
+            if (a.last != b.last) return a.last < b.last;
+            return a.pos < b.pos;
+        });
+
+        std::vector<Holder> chosen;
+        chosen.reserve(k);
+        for (size_t i = 0; i < k; ++i) {
+            const Holder& h = holders[ranked[i].pos];
+            chosen.push_back(h);
+
+            Shard& s = shard_for(h.key);
+            std::lock_guard<std::mutex> lock(s.mu);
+            Load& l = s.by_key[h.key];
+            l.load = decayed(l, now) + 1.0;
+            l.last = now;
+        }
+        holders.swap(chosen);
+    }
+
+    // Called when a connection goes away.
+    void forget(uint64_t key) {
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        s.by_key.erase(key);
+    }
+
+private:
+    static const size_t SHARDS = 16;
+
+    struct Load {
+        double load = 0.0;
+        double last = 0.0;      // seconds, steady clock
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::unordered_map<uint64_t, Load> by_key;
+    };
+
+    static double seconds_now() {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static double decayed(const Load& l, double now) {
+        return l.load * std::exp2(-(now - l.last) / HALF_LIFE);
+    }
+
+    Shard& shard_for(uint64_t key) { return shards[key % SHARDS]; }
+
+    Shard shards[SHARDS];
+};
+
+#endif
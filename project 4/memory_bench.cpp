@@ -0,0 +1,122 @@
+/*
+ * memory_bench.cpp
+ *
+ * Resident memory per 100k published entries, before and after interning.
+ * 10k peers each publish MAX_FILES names drawn from a pool of popular names,
+ * so most names are held by many peers.
+ *
+ *   before: every PeerInfo owns a std::vector<std::string>, and the index
+ *           is a std::unordered_map<std::string, std::vector<Holder>>
+ *   after:  every PeerInfo owns a std::vector<NameId> into FileIndex
+ *
+ * Each layout is built in a forked child so neither sees the other's heap.
+ *
+ * Usage: ./memory_bench [pool size]
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "file_index.h"
+
+const int MAX_FILES = 10;
+const size_t PEERS = 10000;
+
+long rss_kb() {
+    long pages_total = 0, pages_resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) return -1;
+    if (fscanf(f, "%ld %ld", &pages_total, &pages_resident) != 2) pages_resident = -1;
+    fclose(f);
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+std::vector<std::string> make_pool(size_t n) {
+    std::vector<std::string> pool;
+    for (size_t i = 0; i < n; ++i) {
+        pool.push_back("shared/popular_release_" + std::to_string(i) + ".tar.gz");
+    }
+    return pool;
+}
+
+Holder holder_for(size_t peer) {
+    Holder h;
+    h.key = peer + 1;
+    h.peer_id = static_cast<uint32_t>(peer + 1);
+    h.addr = {};
+    h.addr.sin_family = AF_INET;
+    h.addr.sin_port = htons(static_cast<uint16_t>(20000 + peer % 40000));
+    return h;
+}
+
+void build_before(const std::vector<std::string>& pool, std::mt19937& rng) {
+    struct OldPeer { std::vector<std::string> files; };
+    std::vector<OldPeer> peers(PEERS);
+    std::unordered_map<std::string, std::vector<Holder>> by_name;
+    std::uniform_int_distribution<size_t> pick(0, pool.size() - 1);
+
+    long base = rss_kb();
+    for (size_t i = 0; i < PEERS; ++i) {
+        for (int k = 0; k < MAX_FILES; ++k) {
+            // As the PUBLISH handler used to: a string per name off a stack buffer.
+            char filename_buf[100] = {0};
+            pool[pick(rng)].copy(filename_buf, 99);
+            std::string fname(filename_buf);
+            peers[i].files.push_back(fname);
+            by_name[fname].push_back(holder_for(i));
+        }
+    }
+    std::cout << "before: " << (rss_kb() - base) << " KB per 100k entries" << std::endl;
+}
+
+void build_after(const std::vector<std::string>& pool, std::mt19937& rng) {
+    struct NewPeer { std::vector<NameId> files; };
+    std::vector<NewPeer> peers(PEERS);
+    std::unique_ptr<FileIndex> index(new FileIndex());
+    std::uniform_int_distribution<size_t> pick(0, pool.size() - 1);
+
+    long base = rss_kb();
+    for (size_t i = 0; i < PEERS; ++i) {
+        for (int k = 0; k < MAX_FILES; ++k) {
+            NameId id = index->intern(pool[pick(rng)]);
+            peers[i].files.push_back(id);
+            index->add(id, holder_for(i));
+        }
+    }
+    std::cout << "after:  " << (rss_kb() - base) << " KB per 100k entries" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    size_t pool_size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    if (pool_size == 0) pool_size = 1;
+    std::vector<std::string> pool = make_pool(pool_size);
+    std::cout << PEERS * MAX_FILES << " entries over " << pool_size << " distinct names" << std::endl;
+
+    for (int layout = 0; layout < 2; ++layout) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            std::mt19937 rng(446);
+            if (layout == 0) {
+                build_before(pool, rng);
+            } else {
+                build_after(pool, rng);
+            }
+            std::cout.flush();
+            _exit(0);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    return 0;
+}
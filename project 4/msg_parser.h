@@ -0,0 +1,280 @@
+/*
+ * msg_parser.h
+ *
+ * Registry wire format and a resumable parser for it.
+ *
+ *   JOIN    : type(1) peer_id(4)
+ *   PUBLISH : type(1) count(4) count x filename(100, NUL padded)
+ *   PUBLISH_ADD, PUBLISH_REMOVE : same layout as PUBLISH
+ *   PUBLISH_HASHED : type(1) count(4) count x { filename(100) hash(16) }
+ *   HEARTBEAT : type(1), no reply; keeps an otherwise idle peer registered
+ *   CLUSTER_MAP : type(1)
+ *   FETCH_FILTER : type(1) epoch(4) generation(4), of the filter the peer holds
+ *   SEARCH  : type(1) filename(100, NUL padded)
+ *   SEARCH_BATCH : type(1) count(4) count x filename(100, NUL padded)
+ *   SEARCH_PATTERN : type(1) mode(1) limit(4) pattern(100, NUL padded)
+ *   SEARCH_MULTI : type(1) k(4) filename(100, NUL padded)
+ *
+ * A SEARCH_BATCH is answered with count(4) followed by count packed 10-byte
+ * entries, peer_id(4) ip(4) port(2), in request order; all zero on a miss.
+ * Its count has no cap either: names arrive in frames of at most
+ * MAX_SEARCH_BATCH and each is answered as it comes, count going out with
+ * the first.
+ * A SEARCH_PATTERN (mode PATTERN_PREFIX or PATTERN_SUBSTRING) is answered
+ * with count(4) followed by count x { filename(100) entry(10) }.
+ * A SEARCH_MULTI is answered with count(4) followed by up to k entries,
+ * least recently loaded holder first.
+ * A CLUSTER_MAP is answered with count(4) followed by count x { ip(4)
+ * port(2) }, the cluster's registries in configured order; count is 0 for
+ * a standalone registry.
+ * A FETCH_FILTER is answered with kind(1) epoch(4) generation(4) n(4).
+ * FILTER_FULL is followed by the BLOOM_BITS-bit bitmap (n = bits) as 64-bit
+ * big-endian words; FILTER_DELTA by n x { word_index(4) word(8) }, the words
+ * changed since the peer's generation (n = 0 when it is current).
+ *
+ * PUBLISH_HASHED adds names like PUBLISH_ADD, each with the 128-bit hash of
+ * the file's content. The registry files the peer under the name and under
+ * the hash key, '#' and the hash as 32 hex digits, so either can be given to
+ * any SEARCH and to PUBLISH_REMOVE.
+ *
+ * PUBLISH and its ADD/REMOVE/HASHED variants have no cap on count. Their names are
+ * handed to the dispatcher in frames of at most PUBLISH_CHUNK names as they
+ * arrive, so a 100k-name listing is never buffered whole.
+ *
+ * Sockets are non-blocking, so a request may arrive a few bytes at a time.
+ * Each connection owns a RecvBuffer and a FrameParser; the parser remembers
+ * where it stopped (header decoded, filenames still owed) and only hands a
+ * Frame to the dispatcher once the whole request has been received.
+ */
+
+#ifndef MSG_PARSER_H
+#define MSG_PARSER_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+const uint8_t MSG_JOIN    = 1;
+const uint8_t MSG_PUBLISH = 2;
+const uint8_t MSG_SEARCH  = 3;
+const uint8_t MSG_SEARCH_BATCH = 5;
+const uint8_t MSG_SEARCH_PATTERN = 6;
+const uint8_t MSG_SEARCH_MULTI = 7;
+const uint8_t MSG_PUBLISH_ADD = 8;
+const uint8_t MSG_PUBLISH_REMOVE = 9;
+const uint8_t MSG_HEARTBEAT = 10;
+const uint8_t MSG_CLUSTER_MAP = 11;
+const uint8_t MSG_FETCH_FILTER = 12;
+const uint8_t MSG_PUBLISH_HASHED = 13;
+
+const uint8_t FILTER_DELTA = 0;
+const uint8_t FILTER_FULL = 1;
+
+const uint8_t PATTERN_PREFIX = 0;
+const uint8_t PATTERN_SUBSTRING = 1;
+
+const int MAX_FILENAME_LEN = 100;
+const int PUBLISH_CHUNK = 1024;
+const int MAX_SEARCH_BATCH = 1024;
+const int SEARCH_ENTRY_LEN = 10;
+const int MAX_PATTERN_RESULTS = 256;
+const int MAX_MULTI_HOLDERS = 32;
+const int CONTENT_HASH_LEN = 16;
+
+// Bytes received but not yet parsed. Consumed bytes are reclaimed lazily.
+struct RecvBuffer {
+    std::vector<uint8_t> data;
+    size_t head = 0;
+
+    const uint8_t* begin() const { return data.data() + head; }
+    size_t size() const { return data.size() - head; }
+
+    void consume(size_t n) {
+        head += n;
+        if (head == data.size()) {
+            data.clear();
+            head = 0;
+        }
+    }
+
+    // Makes room for at least n more bytes and returns where they go.
+    uint8_t* prepare(size_t n) {
+        if (head > 0 && head >= data.size() / 2) {
+            data.erase(data.begin(), data.begin() + head);
+            head = 0;
+        }
+        size_t used = data.size();
+        data.resize(used + n);
+        return data.data() + used;
+    }
+
+    // Gives back the part of prepare() that recv() did not fill.
+    void commit(size_t reserved, size_t filled) {
+        data.resize(data.size() - reserved + filled);
+    }
+};
+
+// Names are packed back to back in one string rather than allocated one by
+// one; name(k) is a view into it that lives as long as the Frame.
+struct Frame {
+    uint8_t type = 0;
+    uint32_t peer_id = 0;               // JOIN
+    uint32_t count = 0;                 // PUBLISH*/SEARCH_BATCH, as sent; SEARCH_PATTERN/MULTI limit
+    bool continued = false;             // a later frame of a split list
+    uint8_t mode = 0;                   // SEARCH_PATTERN
+    uint32_t epoch = 0;                 // FETCH_FILTER
+    uint32_t generation = 0;            // FETCH_FILTER
+    std::string hashes;                 // PUBLISH_HASHED: CONTENT_HASH_LEN bytes per name
+    std::string name_data;              // up to PUBLISH_CHUNK/MAX_SEARCH_BATCH names, or the SEARCH name
+    std::vector<uint32_t> name_ends;
+
+    size_t name_count() const { return name_ends.size(); }
+
+    const uint8_t* hash(size_t k) const {
+        return reinterpret_cast<const uint8_t*>(hashes.data()) + k * CONTENT_HASH_LEN;
+    }
+
+    std::string_view name(size_t k) const {
+        size_t start = k == 0 ? 0 : name_ends[k - 1];
+        return std::string_view(name_data).substr(start, name_ends[k] - start);
+    }
+
+    void add_name(const char* p, size_t len) {
+        name_data.append(p, len);
+        name_ends.push_back(static_cast<uint32_t>(name_data.size()));
+    }
+};
+
+class FrameParser {
+public:
+    // Pulls the next complete frame out of buf. Returns false if more bytes
+    // are needed; anything already consumed is kept for the next call.
+    bool next(RecvBuffer& buf, Frame& out) {
+        while (true) {
+            switch (state) {
+            case State::TYPE:
+                if (buf.size() < 1) return false;
+                cur = Frame();
+                cur.type = buf.begin()[0];
+                buf.consume(1);
+                if (cur.type == MSG_JOIN) {
+                    state = State::JOIN_ID;
+                } else if (cur.type == MSG_PUBLISH || cur.type == MSG_PUBLISH_ADD
+                           || cur.type == MSG_PUBLISH_REMOVE || cur.type == MSG_PUBLISH_HASHED) {
+                    names_cap = PUBLISH_CHUNK;
+                    hash_len = cur.type == MSG_PUBLISH_HASHED ? CONTENT_HASH_LEN : 0;
+                    state = State::LIST_COUNT;
+                } else if (cur.type == MSG_SEARCH_BATCH) {
+                    names_cap = MAX_SEARCH_BATCH;
+                    hash_len = 0;
+                    state = State::LIST_COUNT;
+                } else if (cur.type == MSG_SEARCH) {
+                    state = State::SEARCH_NAME;
+                } else if (cur.type == MSG_SEARCH_PATTERN) {
+                    state = State::PATTERN;
+                } else if (cur.type == MSG_SEARCH_MULTI) {
+                    state = State::MULTI;
+                } else if (cur.type == MSG_FETCH_FILTER) {
+                    state = State::FILTER;
+                } else if (cur.type == MSG_HEARTBEAT || cur.type == MSG_CLUSTER_MAP) {
+                    return emit(out);
+                }
+                // Unknown types are a single byte and are dropped.
+                break;
+
+            case State::JOIN_ID:
+                if (buf.size() < 4) return false;
+                cur.peer_id = read_u32(buf);
+                return emit(out);
+
+            case State::LIST_COUNT:
+                if (buf.size() < 4) return false;
+                cur.count = read_u32(buf);
+                names_left = cur.count;
+                state = State::LIST_NAMES;
+                break;
+
+            case State::LIST_NAMES:
+                while (names_left > 0) {
+                    if (cur.name_count() == names_cap) {
+                        // Hand over what we have and keep reading the same list.
+                        out = std::move(cur);
+                        cur = Frame();
+                        cur.type = out.type;
+                        cur.count = out.count;
+                        cur.continued = true;
+                        return true;
+                    }
+                    if (buf.size() < (size_t)MAX_FILENAME_LEN + hash_len) return false;
+                    read_name(buf, cur);
+                    cur.hashes.append(reinterpret_cast<const char*>(buf.begin()), hash_len);
+                    buf.consume(hash_len);
+                    --names_left;
+                }
+                return emit(out);
+
+            case State::SEARCH_NAME:
+                if (buf.size() < (size_t)MAX_FILENAME_LEN) return false;
+                read_name(buf, cur);
+                return emit(out);
+
+            case State::PATTERN:
+                if (buf.size() < 1 + 4 + (size_t)MAX_FILENAME_LEN) return false;
+                cur.mode = buf.begin()[0];
+                buf.consume(1);
+                cur.count = read_u32(buf);
+                read_name(buf, cur);
+                return emit(out);
+
+            case State::MULTI:
+                if (buf.size() < 4 + (size_t)MAX_FILENAME_LEN) return false;
+                cur.count = read_u32(buf);
+                read_name(buf, cur);
+                return emit(out);
+
+            case State::FILTER:
+                if (buf.size() < 8) return false;
+                cur.epoch = read_u32(buf);
+                cur.generation = read_u32(buf);
+                return emit(out);
+            }
+        }
+    }
+
+private:
+    // LIST_* read the count-prefixed filename lists of PUBLISH* and
+    // SEARCH_BATCH, with hash_len hash bytes after each name, split into
+    // frames of names_cap names.
+    enum class State { TYPE, JOIN_ID, LIST_COUNT, LIST_NAMES, SEARCH_NAME, PATTERN, MULTI, FILTER };
+
+    static uint32_t read_u32(RecvBuffer& buf) {
+        uint32_t v;
+        std::memcpy(&v, buf.begin(), sizeof(v));
+        buf.consume(sizeof(v));
+        return ntohl(v);
+    }
+
+    static void read_name(RecvBuffer& buf, Frame& f) {
+        const char* p = reinterpret_cast<const char*>(buf.begin());
+        f.add_name(p, strnlen(p, MAX_FILENAME_LEN - 1));
+        buf.consume(MAX_FILENAME_LEN);
+    }
+
+    bool emit(Frame& out) {
+        out = std::move(cur);
+        cur = Frame();
+        state = State::TYPE;
+        return true;
+    }
+
+    State state = State::TYPE;
+    uint32_t names_left = 0;
+    size_t names_cap = 0;
+    size_t hash_len = 0;
+    Frame cur;
+};
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * pattern_index.h
+ *
+ * Prefix and substring lookup over every interned filename, for the
+ * registry's SEARCH_PATTERN request.
+ *
+ *   prefix:    a radix trie (single-child chains collapsed into one edge
+ *              label), walked down to the prefix and then enumerated
+ *   substring: a trigram index; the pattern's rarest trigram picks the
+ *              candidates, which are then checked with string::find
+ *              (patterns shorter than three bytes scan all names)
+ *
+ * FileIndex keeps it current as names are created and freed. Queries only
+ * collect NameIds; the caller resolves holders after releasing this lock.
+ */
+
+#ifndef PATTERN_INDEX_H
+#define PATTERN_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <shared_mutex>
+#include <cstdint>
+
+typedef uint32_t NameId;
+
+class PatternIndex {
+public:
+    void insert(std::string_view name, NameId id) {
+        std::unique_lock<std::shared_mutex> lock(mu);
+        if (!names.emplace(id, std::string(name)).second) return;
+        trie_insert(root, name, id);
+        for_each_trigram(name, [&](uint32_t t) {
+            postings[t].push_back(id);
+            ++total_postings;
+        });
+    }
+
+    void erase(std::string_view name, NameId id) {
+        std::unique_lock<std::shared_mutex> lock(mu);
+        if (names.erase(id) == 0) return;
+        trie_erase(root, name);
+
+        // Posting lists are cleaned lazily: queries skip ids that are no
+        // longer in names, and the lists are rebuilt once stale entries
+        // outnumber live ones.
+        for_each_trigram(name, [&](uint32_t) { ++stale_postings; });
+        if (stale_postings > 1024 && stale_postings > total_postings - stale_postings) {
+            rebuild_postings();
+        }
+    }
+
+    // Up to limit names starting with prefix, in byte order.
+    std::vector<std::pair<NameId, std::string>> find_prefix(std::string_view prefix, size_t limit) const {
+        std::shared_lock<std::shared_mutex> lock(mu);
+        std::vector<std::pair<NameId, std::string>> out;
+
+        const Node* node = &root;
+        std::string path;
+        std::string_view rest = prefix;
+        while (!rest.empty()) {
+            const Node* next = child_for(*node, rest[0]);
+            if (next == nullptr) return out;
+            size_t common = common_prefix(next->label, rest);
+            if (common < rest.size() && common < next->label.size()) return out;
+            path += next->label;
+            rest.remove_prefix(common);
+            node = next;
+        }
+        collect(*node, path, limit, out);
+        return out;
+    }
+
+    // Up to limit names containing pattern, in no particular order.
+    std::vector<std::pair<NameId, std::string>> find_substring(std::string_view pattern, size_t limit) const {
+        std::shared_lock<std::shared_mutex> lock(mu);
+        std::vector<std::pair<NameId, std::string>> out;
+
+        // A stale posting can repeat an id that was freed and handed out again.
+        std::unordered_set<NameId> seen;
+        auto check = [&](NameId id, const std::string& name) {
+            if (name.find(pattern) != std::string::npos && seen.insert(id).second) {
+                out.emplace_back(id, name);
+            }
+            return out.size() < limit;
+        };
+
+        if (pattern.size() < 3) {
+            for (const auto& n : names) {
+                if (!check(n.first, n.second)) break;
+            }
+            return out;
+        }
+
+        const std::vector<NameId>* best = nullptr;
+        bool missing = false;
+        for_each_trigram(pattern, [&](uint32_t t) {
+            auto found = postings.find(t);
+            if (found == postings.end()) {
+                missing = true;
+            } else if (best == nullptr || found->second.size() < best->size()) {
+                best = &found->second;
+            }
+        });
+        if (missing || best == nullptr) return out;
+
+        for (NameId id : *best) {
+            auto found = names.find(id);
+            if (found == names.end()) continue;
+            if (!check(id, found->second)) break;
+        }
+        return out;
+    }
+
+private:
+    struct Node {
+        std::string label;              // edge label from the parent
+        bool terminal = false;
+        NameId id = 0;
+        std::vector<std::unique_ptr<Node>> children;    // sorted by label[0]
+    };
+
+    static size_t common_prefix(std::string_view a, std::string_view b) {
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n]) ++n;
+        return n;
+    }
+
+    static size_t child_pos(const Node& node, char c) {
+        size_t lo = 0, hi = node.children.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if ((unsigned char)node.children[mid]->label[0] < (unsigned char)c) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    static const Node* child_for(const Node& node, char c) {
+        size_t pos = child_pos(node, c);
+        if (pos < node.children.size() && node.children[pos]->label[0] == c) {
+            return node.children[pos].get();
+        }
+        return nullptr;
+    }
+
+    static void trie_insert(Node& root, std::string_view name, NameId id) {
+        Node* node = &root;
+        while (!name.empty()) {
+            size_t pos = child_pos(*node, name[0]);
+            if (pos == node->children.size() || node->children[pos]->label[0] != name[0]) {
+                std::unique_ptr<Node> leaf(new Node());
+                leaf->label = std::string(name);
+                leaf->terminal = true;
+                leaf->id = id;
+                node->children.insert(node->children.begin() + pos, std::move(leaf));
+                return;
+            }
+
+            Node* child = node->children[pos].get();
+            size_t common = common_prefix(child->label, name);
+            if (common < child->label.size()) {
+                // Split the edge: the shared part becomes a new inner node.
+                std::unique_ptr<Node> mid(new Node());
+                mid->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                mid->children.push_back(std::move(node->children[pos]));
+                node->children[pos] = std::move(mid);
+                child = node->children[pos].get();
+            }
+            name.remove_prefix(common);
+            node = child;
+        }
+        node->terminal = true;
+        node->id = id;
+    }
+
+    // Returns true if node became empty and should be removed by its parent.
+    static bool trie_erase(Node& node, std::string_view name) {
+        if (name.empty()) {
+            node.terminal = false;
+        } else {
+            size_t pos = child_pos(node, name[0]);
+            if (pos == node.children.size()) return false;
+            Node& child = *node.children[pos];
+            if (name.substr(0, child.label.size()) != child.label) return false;
+
+            if (trie_erase(child, name.substr(child.label.size()))) {
+                node.children.erase(node.children.begin() + pos);
+            } else if (!child.terminal && child.children.size() == 1) {
+                // Keep the trie compressed: fold a pass-through node into its child.
+                std::unique_ptr<Node> only = std::move(child.children[0]);
+                only->label = child.label + only->label;
+                node.children[pos] = std::move(only);
+            }
+        }
+        return !node.terminal && node.children.empty() && !node.label.empty();
+    }
+
+    static void collect(const Node& node, std::string& path, size_t limit,
+                        std::vector<std::pair<NameId, std::string>>& out) {
+        if (out.size() >= limit) return;
+        if (node.terminal) out.emplace_back(node.id, path);
+        for (const auto& child : node.children) {
+            if (out.size() >= limit) return;
+            path += child->label;
+            collect(*child, path, limit, out);
+            path.resize(path.size() - child->label.size());
+        }
+    }
+
+    template <typename F>
+    static void for_each_trigram(std::string_view s, F f) {
+        for (size_t i = 0; i + 3 <= s.size(); ++i) {
+            f(((uint32_t)(unsigned char)s[i] << 16) | ((uint32_t)(unsigned char)s[i + 1] << 8)
+              | (uint32_t)(unsigned char)s[i + 2]);
+        }
+    }
+
+    void rebuild_postings() {
+        postings.clear();
+        total_postings = 0;
+        for (const auto& n : names) {
+            for_each_trigram(n.second, [&](uint32_t t) {
+                postings[t].push_back(n.first);
+                ++total_postings;
+            });
+        }
+        stale_postings = 0;
+    }
+
+    mutable std::shared_mutex mu;
+    Node root;
+    std::unordered_map<NameId, std::string> names;
+    std::unordered_map<uint32_t, std::vector<NameId>> postings;
+    size_t total_postings = 0;
+    size_t stale_postings = 0;
+};
+
+#endif
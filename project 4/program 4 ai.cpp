@@ -4,14 +4,30 @@
  * Class: EECE 446
  * Semester: Fall 2025
  *
- * Description: A single-threaded P2P registry using poll() for I/O multiplexing.
- * It manages peer connections, indexes files, and handles SEARCH requests.
+ * Description: A P2P registry using epoll (or poll) over non-blocking sockets
+ * for I/O multiplexing. It manages peer connections, indexes files, and
+ * handles SEARCH requests. With --threads N it runs N event loops, each with
+ * its own SO_REUSEPORT listener, sharing one file index. With --snapshot FILE
+ * the index is saved periodically and reloaded on startup; peers in it that
+ * do not JOIN again within the idle timeout (five minutes without one) are
+ * dropped. Trace lines are written by a background thread every
+ * --log-flush-ms milliseconds. With --idle-timeout SECS, peers that send
+ * nothing (not even a HEARTBEAT) for that long are evicted by a timer wheel
+ * in each event loop. With --cluster,
+ * several registries split the filename space by consistent hashing and
+ * each only indexes the names it owns.
  */
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -21,47 +37,138 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <endian.h>
 
-const uint8_t MSG_JOIN    = 1;
-const uint8_t MSG_PUBLISH = 2;
-const uint8_t MSG_SEARCH  = 3;
+#include "file_index.h"
+#include "conn_table.h"
+#include "snapshot.h"
+#include "load_tracker.h"
+#include "trace_log.h"
+#include "hash_ring.h"
+#include "uring.h"
 
-const int MAX_FILES = 10;
-const int MAX_FILENAME_LEN = 100;
 const int BACKLOG = 10;
+const int MAX_EVENTS = 256;
+const size_t RECV_CHUNK = 16384;
+const int DEFAULT_SNAPSHOT_INTERVAL = 30;
+const int DEFAULT_LOG_FLUSH_MS = 10;
+// Peers restored from a snapshot that have not JOINed again this long after
+// startup (or --idle-timeout, if set) are dropped from the index.
+const int DEFAULT_RESTORE_GRACE = 300;
+// Idle timers are kept at this resolution.
+const int IDLE_TICK_MS = 100;
+// io_uring backend: ring size, provided receive buffers, SENDs per link chain.
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_BUFFERS = 512;
+const unsigned URING_BUFFER_SIZE = 4096;
+const size_t URING_MAX_LINKED_SENDS = 16;
 
-struct PeerInfo {
-    int socket_fd;
-    uint32_t id;
-    struct sockaddr_in addr;
-    std::vector<std::string> files;
-    bool has_joined;
+// Totals over every event loop, reported at shutdown so the backends can be
+// compared. syscalls counts the calls made on the request path.
+struct IoStats {
+    std::atomic<uint64_t> syscalls{0};
+    std::atomic<uint64_t> requests{0};
+};
+IoStats io_stats;
+
+void count_syscalls(uint64_t n) {
+    io_stats.syscalls.fetch_add(n, std::memory_order_relaxed);
+}
+// How many holders of a name SEARCH_MULTI ranks per request.
+const size_t MULTI_CANDIDATES = 64;
+
+// State shared by every event loop.
+struct Registry {
+    FileIndex index;
+    LoadTracker load;
+    std::atomic<uint64_t> next_key{1};
+    std::atomic<uint64_t> multi_cursor{0};
+
+    // Idle eviction; 0 ticks means disabled.
+    uint64_t idle_ticks = 0;
+    std::atomic<uint64_t> evicted_peers{0};
+    std::atomic<uint64_t> evicted_entries{0};
+
+    // Cluster mode; self_node is -1 for a standalone registry.
+    HashRing ring;
+    int self_node = -1;
+    std::vector<struct sockaddr_in> members;
+    std::atomic<uint64_t> misrouted{0};
+
+    bool owns(std::string_view name) const {
+        return self_node < 0 || ring.owner(name) == (size_t)self_node;
+    }
+
+    // Peers restored from a snapshot that have not JOINed again, by peer id.
+    // Whoever is left at restored_deadline is released.
+    std::mutex restored_mu;
+    std::unordered_map<uint32_t, std::vector<RestoredPeer>> restored;
+    std::chrono::steady_clock::time_point restored_deadline;
+};
+
+// One event loop: its own listening socket and the connections it accepted.
+struct Reactor {
+    Registry& reg;
+    int listen_sock;
+    ConnTable conns;
+    TimerWheel idle_timers;
+
+    explicit Reactor(Registry& r);
 };
 
 struct SearchResponse {
     uint32_t peer_id;
     uint32_t ip_addr;
     uint16_t port;
-}
+};
 
 void error_exit(const char* msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-bool recv_all(int sock, void* buffer, size_t length) {
-    size_t total_received = 0;
-    char* ptr = (char*)buffer;
-    
-    while (total_received < length) {
-        ssize_t received = recv(sock, ptr + total_received, length - total_received, 0);
-        if (received <= 0) {
-            return false;
-        }
-        total_received += received;
-    }
-    return true;
+TraceLog trace_log;
+
+// Queues one trace line for the log writer; lines from different event
+// loops never interleave.
+void log_line(std::string line) {
+    trace_log.push(std::move(line));
+}
+
+// SIGINT/SIGTERM are blocked in every thread and taken here instead, so the
+// trace lines still queued reach stdout before the process exits.
+void run_signal_waiter(sigset_t set) {
+    int sig = 0;
+    sigwait(&set, &sig);
+    trace_log.stop();
+    uint64_t requests = io_stats.requests.load();
+    uint64_t syscalls = io_stats.syscalls.load();
+    std::cerr << "Served " << requests << " requests with " << syscalls << " I/O syscalls";
+    if (requests > 0) std::cerr << " (" << double(syscalls) / requests << " per request)";
+    std::cerr << std::endl;
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    raise(sig);
+}
+
+uint64_t now_tick() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() / IDLE_TICK_MS;
+}
+
+Reactor::Reactor(Registry& r) : reg(r), listen_sock(-1), idle_timers(now_tick()) {}
+
+Holder make_holder(const PeerInfo& p) {
+    Holder h;
+    h.key = p.key;
+    h.peer_id = p.id;
+    h.addr = p.addr;
+    return h;
 }
 
 std::string get_ip_str(const struct sockaddr_in& addr) {
@@ -72,17 +179,7 @@ std::string get_ip_str(const struct sockaddr_in& addr) {
     return std::string(ip_str);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
-        return EXIT_FAILURE;
-    }
-    int port = std::atoi(argv[1]);
-    if (port <= 0 || port > 65535) {
-        std::cerr << "Invalid port number." << std::endl;
-        return EXIT_FAILURE;
-    }
-
+int open_listener(int port, bool reuse_port) {
     int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_sock < 0) error_exit("socket");
 
@@ -90,6 +187,11 @@ int main(int argc, char* argv[]) {
     if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         error_exit("setsockopt");
     }
+    // Every event loop binds its own socket to the port; the kernel spreads
+    // incoming connections across them.
+    if (reuse_port && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        error_exit("setsockopt");
+    }
 
     struct sockaddr_in server_addr = {};
     server_addr.sin_family = AF_INET;
@@ -103,139 +205,1016 @@ int main(int argc, char* argv[]) {
     if (listen(listen_sock, BACKLOG) < 0) {
         error_exit("listen");
     }
+    return listen_sock;
+}
+
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        error_exit("fcntl");
+    }
+}
+
+// Adds a connected socket to the loop's table.
+PeerInfo* add_peer(Reactor& loop, int new_fd, const struct sockaddr_in& client_addr) {
+    std::unique_ptr<PeerInfo> new_peer(new PeerInfo());
+    new_peer->socket_fd = new_fd;
+    new_peer->key = loop.reg.next_key++;
+    new_peer->id = 0;
+    new_peer->addr = client_addr;
+    new_peer->has_joined = false;
+    new_peer->last_active = now_tick();
+    new_peer->idle_timer.owner = new_peer.get();
+    if (loop.reg.idle_ticks > 0) {
+        loop.idle_timers.schedule(&new_peer->idle_timer, new_peer->last_active + loop.reg.idle_ticks);
+    }
+
+    struct sockaddr_in peer_addr_check = {};
+    socklen_t len = sizeof(peer_addr_check);
+    count_syscalls(1);
+    if (getpeername(new_fd, (struct sockaddr*)&peer_addr_check, &len) == 0) {
+        new_peer->addr = peer_addr_check;
+    }
 
+    return loop.conns.add(std::move(new_peer));
+}
+
+// Registers an accepted socket. Returns nullptr if accept() had nothing or failed.
+PeerInfo* accept_peer(Reactor& loop) {
+    struct sockaddr_in client_addr = {};
+    socklen_t addr_len = sizeof(client_addr);
+    count_syscalls(1);
+    int new_fd = accept(loop.listen_sock, (struct sockaddr*)&client_addr, &addr_len);
+
+    if (new_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+        return nullptr;
+    }
+
+    count_syscalls(2);
+    set_nonblocking(new_fd);
+    return add_peer(loop, new_fd, client_addr);
+}
+
+// Takes the peer out of the index and every other shared structure. The
+// socket and the PeerInfo itself are left to the caller.
+void forget_peer(Reactor& loop, PeerInfo* peer) {
+    loop.reg.index.release_all(std::vector<NameId>(peer->files.begin(), peer->files.end()),
+                               peer->key);
+    peer->files.clear();
+    loop.reg.load.forget(peer->key);
+    loop.idle_timers.cancel(&peer->idle_timer);
+}
+
+// Disconnect logic shared by the poll and epoll backends. Frees the PeerInfo.
+void drop_peer(Reactor& loop, PeerInfo* peer) {
+    forget_peer(loop, peer);
+    count_syscalls(1);
+    close(peer->socket_fd);
+    loop.conns.remove(peer);
+}
+
+// Sends as much of the peer's pending replies as the socket accepts.
+// Returns false if the connection is broken.
+bool flush_tx(PeerInfo& peer) {
+    while (!peer.tx.empty()) {
+        count_syscalls(1);
+        ssize_t n = send(peer.socket_fd, peer.tx.data(), peer.tx.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            return false;
+        }
+        peer.tx.erase(0, n);
+    }
+    return true;
+}
+
+void queue_reply(PeerInfo& peer, const void* data, size_t len) {
+    peer.tx.append(static_cast<const char*>(data), len);
+}
+
+// Writes a reply made of several pieces with one writev() instead of first
+// copying them together. Whatever the socket does not take is queued behind
+// any earlier replies. The io_uring backend sends everything itself, so
+// for its peers this only queues.
+void send_reply_vec(PeerInfo& peer, struct iovec* iov, int iovcnt) {
+    size_t sent = 0;
+    if (peer.tx.empty() && !peer.defer_send) {
+        count_syscalls(1);
+        ssize_t n = writev(peer.socket_fd, iov, iovcnt);
+        if (n > 0) sent = n;
+    }
+    for (int v = 0; v < iovcnt; ++v) {
+        size_t len = iov[v].iov_len;
+        if (sent >= len) {
+            sent -= len;
+            continue;
+        }
+        queue_reply(peer, static_cast<const char*>(iov[v].iov_base) + sent, len - sent);
+        sent = 0;
+    }
+}
+
+// The index key for a content hash: HASH_KEY_PREFIX and 32 hex digits.
+std::string hash_key(const uint8_t* hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string key(1, HASH_KEY_PREFIX);
+    for (int i = 0; i < CONTENT_HASH_LEN; ++i) {
+        key += digits[hash[i] >> 4];
+        key += digits[hash[i] & 15];
+    }
+    return key;
+}
+
+// Looks one name up, logs it, and packs the 10-byte answer into out.
+void search_one(Registry& reg, std::string_view target_file, uint8_t* out) {
+    Holder h;
+    bool found = reg.index.find_first(target_file, h);
+    uint32_t peer_id = found ? htonl(h.peer_id) : 0;
+    uint32_t ip_addr = found ? h.addr.sin_addr.s_addr : 0;
+    uint16_t port = found ? h.addr.sin_port : 0;
+
+    std::memcpy(out, &peer_id, 4);
+    std::memcpy(out + 4, &ip_addr, 4);
+    std::memcpy(out + 8, &port, 2);
+
+    if (found) {
+        log_line("TEST] SEARCH " + std::string(target_file) + " "
+                 + std::to_string(h.peer_id) + " "
+                 + get_ip_str(h.addr) + ":"
+                 + std::to_string(ntohs(h.addr.sin_port)));
+    } else {
+        log_line("TEST] SEARCH " + std::string(target_file) + " 0 0.0.0.0:0");
+    }
+}
+
+// A peer that was known before the registry restarted takes back the names
+// it had published, matched on peer id and IP, without republishing them.
+void adopt_restored(Registry& reg, PeerInfo& peer) {
+    RestoredPeer old;
+    {
+        std::lock_guard<std::mutex> lock(reg.restored_mu);
+        auto found = reg.restored.find(peer.id);
+        if (found == reg.restored.end()) return;
+
+        std::vector<RestoredPeer>& same_id = found->second;
+        auto it = same_id.begin();
+        while (it != same_id.end() && it->addr.sin_addr.s_addr != peer.addr.sin_addr.s_addr) ++it;
+        if (it == same_id.end()) return;
+
+        old = std::move(*it);
+        same_id.erase(it);
+        if (same_id.empty()) reg.restored.erase(found);
+    }
+
+    // The caller re-adds every file under the new key right after this. A
+    // name the peer has published again since already holds its own
+    // reference, so the restored one is dropped.
+    for (NameId f : old.files) {
+        if (peer.files.insert(f).second) {
+            reg.index.remove(f, old.key);
+        } else {
+            reg.index.release(f, old.key);
+        }
+    }
+}
+
+void handle_frame(Registry& reg, PeerInfo& current_peer, const Frame& frame) {
+    if (frame.type == MSG_JOIN) {
+        current_peer.id = frame.peer_id;
+        current_peer.has_joined = true;
+        adopt_restored(reg, current_peer);
+
+        // Files published before JOIN become searchable now;
+        // a repeated JOIN refreshes the id stored in the index.
+        for (const auto& f : current_peer.files) {
+            reg.index.remove(f, current_peer.key);
+            reg.index.add(f, make_holder(current_peer));
+        }
+
+        log_line("TEST] JOIN " + std::to_string(current_peer.id));
+
+    } else if (frame.type == MSG_PUBLISH || frame.type == MSG_PUBLISH_ADD
+               || frame.type == MSG_PUBLISH_HASHED) {
+        // All add to what the peer already shares; a long list arrives as
+        // several frames and each is logged on its own.
+        std::ostringstream line;
+        line << (frame.type == MSG_PUBLISH ? "TEST] PUBLISH "
+                 : frame.type == MSG_PUBLISH_ADD ? "TEST] PUBLISH-ADD " : "TEST] PUBLISH-HASHED ")
+             << frame.name_count();
+
+        // Files the peer under key unless another node owns it.
+        auto publish_key = [&](std::string_view key) {
+            if (!reg.owns(key)) return false;
+            NameId id;
+            if (reg.index.find_id(key, id) && current_peer.files.count(id) != 0) {
+                return true;
+            }
+            id = reg.index.intern(key);
+            current_peer.files.insert(id);
+            if (current_peer.has_joined) {
+                reg.index.add(id, make_holder(current_peer));
+            }
+            return true;
+        };
+
+        size_t misrouted = 0;
+        for (size_t k = 0; k < frame.name_count(); ++k) {
+            line << " " << frame.name(k);
+            // A hashed name is also filed under its hash key, which may be
+            // owned by a different node; the peer sends it to both.
+            bool owned = publish_key(frame.name(k));
+            if (frame.type == MSG_PUBLISH_HASHED) {
+                std::string key = hash_key(frame.hash(k));
+                line << " " << key;
+                owned = publish_key(key) || owned;
+            }
+            if (!owned) ++misrouted;
+        }
+        log_line(line.str());
+        if (misrouted > 0) {
+            uint64_t total = reg.misrouted += misrouted;
+            std::ostringstream msg;
+            msg << "Ignored " << misrouted << " names owned by other cluster nodes ("
+                << total << " so far)\n";
+            std::cerr << msg.str();
+        }
+
+    } else if (frame.type == MSG_PUBLISH_REMOVE) {
+        std::ostringstream line;
+        line << "TEST] PUBLISH-REMOVE " << frame.name_count();
+
+        for (size_t k = 0; k < frame.name_count(); ++k) {
+            line << " " << frame.name(k);
+            NameId id;
+            if (!reg.index.find_id(frame.name(k), id) || current_peer.files.erase(id) == 0) {
+                continue;
+            }
+            reg.index.release(id, current_peer.key);
+        }
+        log_line(line.str());
+
+    } else if (frame.type == MSG_SEARCH) {
+        uint8_t entry[SEARCH_ENTRY_LEN];
+        search_one(reg, frame.name(0), entry);
+
+        SearchResponse resp = {};
+        std::memcpy(&resp.peer_id, entry, 4);
+        std::memcpy(&resp.ip_addr, entry + 4, 4);
+        std::memcpy(&resp.port, entry + 8, 2);
+        queue_reply(current_peer, &resp, sizeof(resp));
+
+    } else if (frame.type == MSG_SEARCH_BATCH) {
+        // A long batch arrives as several frames; the count the peer sent
+        // goes out once, ahead of the first frame's entries.
+        std::vector<uint8_t> entries(frame.name_count() * SEARCH_ENTRY_LEN);
+        for (size_t k = 0; k < frame.name_count(); ++k) {
+            search_one(reg, frame.name(k), entries.data() + k * SEARCH_ENTRY_LEN);
+        }
+
+        uint32_t count_net = htonl(frame.count);
+        struct iovec iov[2];
+        iov[0].iov_base = &count_net;
+        iov[0].iov_len = sizeof(count_net);
+        iov[1].iov_base = entries.data();
+        iov[1].iov_len = entries.size();
+        if (frame.continued) {
+            send_reply_vec(current_peer, iov + 1, 1);
+        } else {
+            send_reply_vec(current_peer, iov, 2);
+        }
+
+    } else if (frame.type == MSG_SEARCH_PATTERN) {
+        std::string_view pattern = frame.name(0);
+        size_t limit = std::min<size_t>(frame.count, MAX_PATTERN_RESULTS);
+        bool prefix = frame.mode != PATTERN_SUBSTRING;
+        std::vector<PatternMatch> matches = reg.index.find_pattern(prefix, pattern, limit);
+
+        const size_t rec_len = MAX_FILENAME_LEN + SEARCH_ENTRY_LEN;
+        std::vector<uint8_t> records(matches.size() * rec_len, 0);
+        for (size_t k = 0; k < matches.size(); ++k) {
+            uint8_t* rec = records.data() + k * rec_len;
+            const PatternMatch& m = matches[k];
+            std::memcpy(rec, m.name.data(), std::min<size_t>(m.name.size(), MAX_FILENAME_LEN - 1));
+
+            uint32_t peer_id = htonl(m.holder.peer_id);
+            std::memcpy(rec + MAX_FILENAME_LEN, &peer_id, 4);
+            std::memcpy(rec + MAX_FILENAME_LEN + 4, &m.holder.addr.sin_addr.s_addr, 4);
+            std::memcpy(rec + MAX_FILENAME_LEN + 8, &m.holder.addr.sin_port, 2);
+        }
+
+        log_line("TEST] SEARCH-PATTERN " + std::string(prefix ? "prefix " : "substring ")
+                 + std::string(pattern) + " " + std::to_string(matches.size()));
+
+        uint32_t count_net = htonl(static_cast<uint32_t>(matches.size()));
+        struct iovec iov[2];
+        iov[0].iov_base = &count_net;
+        iov[0].iov_len = sizeof(count_net);
+        iov[1].iov_base = records.data();
+        iov[1].iov_len = records.size();
+        send_reply_vec(current_peer, iov, 2);
+
+    } else if (frame.type == MSG_CLUSTER_MAP) {
+        std::string reply(4 + reg.members.size() * 6, '\0');
+        uint32_t count_net = htonl(static_cast<uint32_t>(reg.members.size()));
+        std::memcpy(&reply[0], &count_net, 4);
+        for (size_t i = 0; i < reg.members.size(); ++i) {
+            std::memcpy(&reply[4 + i * 6], &reg.members[i].sin_addr.s_addr, 4);
+            std::memcpy(&reply[4 + i * 6 + 4], &reg.members[i].sin_port, 2);
+        }
+        queue_reply(current_peer, reply.data(), reply.size());
+
+    } else if (frame.type == MSG_FETCH_FILTER) {
+        uint32_t gen = 0;
+        std::vector<std::pair<uint32_t, uint64_t>> changed;
+        std::vector<uint64_t> full;
+        bool is_delta = reg.index.filter().delta(frame.epoch, frame.generation, gen, changed, full);
+
+        std::string reply(1 + 4 + 4 + 4, '\0');
+        reply[0] = is_delta ? FILTER_DELTA : FILTER_FULL;
+        uint32_t epoch_net = htonl(reg.index.filter().epoch());
+        uint32_t gen_net = htonl(gen);
+        uint32_t n_net = htonl(is_delta ? changed.size() : BLOOM_BITS);
+        std::memcpy(&reply[1], &epoch_net, 4);
+        std::memcpy(&reply[5], &gen_net, 4);
+        std::memcpy(&reply[9], &n_net, 4);
+        if (is_delta) {
+            reply.resize(13 + changed.size() * 12);
+            for (size_t i = 0; i < changed.size(); ++i) {
+                uint32_t w = htonl(changed[i].first);
+                uint64_t bits = htobe64(changed[i].second);
+                std::memcpy(&reply[13 + i * 12], &w, 4);
+                std::memcpy(&reply[13 + i * 12 + 4], &bits, 8);
+            }
+        } else {
+            reply.resize(13 + full.size() * 8);
+            for (size_t i = 0; i < full.size(); ++i) {
+                uint64_t bits = htobe64(full[i]);
+                std::memcpy(&reply[13 + i * 8], &bits, 8);
+            }
+        }
+        queue_reply(current_peer, reply.data(), reply.size());
+
+        log_line("TEST] FETCH-FILTER " + std::to_string(frame.generation) + " -> "
+                 + std::to_string(gen) + (is_delta ? " delta " + std::to_string(changed.size())
+                                                   : std::string(" full")));
+
+    } else if (frame.type == MSG_SEARCH_MULTI) {
+        std::string_view target_file = frame.name(0);
+        size_t k = std::min<size_t>(frame.count, MAX_MULTI_HOLDERS);
+
+        // Rank a rotating window of holders so popular names with many
+        // holders still cost O(MULTI_CANDIDATES) and every holder gets a turn.
+        uint64_t start = reg.multi_cursor.fetch_add(1, std::memory_order_relaxed);
+        std::vector<Holder> holders = reg.index.find_some(target_file, start, MULTI_CANDIDATES);
+        reg.load.pick(holders, k);
+
+        std::vector<uint8_t> entries(holders.size() * SEARCH_ENTRY_LEN);
+        std::ostringstream line;
+        line << "TEST] SEARCH-MULTI " << target_file << " " << holders.size();
+        for (size_t i = 0; i < holders.size(); ++i) {
+            uint8_t* e = entries.data() + i * SEARCH_ENTRY_LEN;
+            uint32_t peer_id = htonl(holders[i].peer_id);
+            std::memcpy(e, &peer_id, 4);
+            std::memcpy(e + 4, &holders[i].addr.sin_addr.s_addr, 4);
+            std::memcpy(e + 8, &holders[i].addr.sin_port, 2);
+            line << " " << holders[i].peer_id;
+        }
+        log_line(line.str());
+
+        uint32_t count_net = htonl(static_cast<uint32_t>(holders.size()));
+        struct iovec iov[2];
+        iov[0].iov_base = &count_net;
+        iov[0].iov_len = sizeof(count_net);
+        iov[1].iov_base = entries.data();
+        iov[1].iov_len = entries.size();
+        send_reply_vec(current_peer, iov, 2);
+    }
+}
+
+// Handles every complete frame in the peer's receive buffer. A partial
+// frame simply waits there for more bytes.
+void dispatch_frames(Reactor& loop, PeerInfo& peer) {
+    Frame frame;
+    while (peer.parser.next(peer.rx, frame)) {
+        handle_frame(loop.reg, peer, frame);
+        io_stats.requests.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Drains the socket, dispatching the complete frames after each RECV_CHUNK
+// so the receive buffer holds at most one chunk and a partial frame however
+// fast the peer sends, and pipelined requests are still answered in one
+// wakeup. Returns false once the peer has gone away.
+bool serve_peer(Reactor& loop, PeerInfo& peer) {
+    bool open = true;
+    while (true) {
+        uint8_t* dst = peer.rx.prepare(RECV_CHUNK);
+        count_syscalls(1);
+        ssize_t n = recv(peer.socket_fd, dst, RECV_CHUNK, 0);
+        peer.rx.commit(RECV_CHUNK, n > 0 ? n : 0);
+        if (n > 0) {
+            // Only stamped here; the idle timer re-arms itself when it fires.
+            peer.last_active = now_tick();
+            dispatch_frames(loop, peer);
+            continue;
+        }
+        if (n == 0) {
+            open = false;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            open = false;
+        }
+        break;
+    }
+    return flush_tx(peer) && open;
+}
+
+// Fires due idle timers. A peer that has been heard from since its timer
+// was armed is re-armed for last_active + timeout; the rest are handed to
+// evict, which must drop them.
+template <typename F>
+void expire_idle(Reactor& loop, F evict) {
+    if (loop.reg.idle_ticks == 0) return;
+    uint64_t now = now_tick();
+    loop.idle_timers.advance(now, [&](TimerNode* t) {
+        PeerInfo* peer = static_cast<PeerInfo*>(t->owner);
+        uint64_t deadline = peer->last_active + loop.reg.idle_ticks;
+        if (deadline > now) {
+            loop.idle_timers.schedule(t, deadline);
+            return;
+        }
+
+        uint64_t entries = peer->has_joined ? peer->files.size() : 0;
+        uint64_t peers_total = ++loop.reg.evicted_peers;
+        uint64_t entries_total = loop.reg.evicted_entries += entries;
+        std::ostringstream msg;
+        msg << "Evicted idle peer " << peer->id << " (" << entries << " entries); "
+            << peers_total << " peers, " << entries_total << " entries evicted so far\n";
+        std::cerr << msg.str();
+        evict(peer);
+    });
+}
+
+int wait_timeout_ms(const Reactor& loop) {
+    return loop.reg.idle_ticks > 0 && loop.idle_timers.size() > 0 ? IDLE_TICK_MS : -1;
+}
+
+// pfds[0] is the listener and pfds[i + 1] belongs to loop.conns.at(i); both
+// sides are swap-removed together so they stay aligned.
+void run_poll(Reactor& loop) {
     std::vector<struct pollfd> pfds;
-    std::vector<PeerInfo> peers;
 
     struct pollfd listener_pfd;
-    listener_pfd.fd = listen_sock;
+    listener_pfd.fd = loop.listen_sock;
     listener_pfd.events = POLLIN;
+    listener_pfd.revents = 0;
     pfds.push_back(listener_pfd);
 
     while (true) {
-        int poll_count = poll(pfds.data(), pfds.size(), -1);
+        count_syscalls(1);
+        int poll_count = poll(pfds.data(), pfds.size(), wait_timeout_ms(loop));
 
         if (poll_count < 0) {
+            if (errno == EINTR) continue;
             error_exit("poll");
         }
-        for (size_t i = 0; i < pfds.size(); ++i) {
-            if (pfds[i].revents & POLLIN) {
-                if (pfds[i].fd == listen_sock) {
-                    struct sockaddr_in client_addr = {};
-                    socklen_t addr_len = sizeof(client_addr);
-                    int new_fd = accept(listen_sock, (struct sockaddr*)&client_addr, &addr_len);
-                    
-                    if (new_fd < 0) {
-                        perror("accept");
-                    } else {
-                        struct pollfd client_pfd;
-                        client_pfd.fd = new_fd;
-                        client_pfd.events = POLLIN;
-                        pfds.push_back(client_pfd);
-
-                        PeerInfo new_peer;
-                        new_peer.socket_fd = new_fd;
-                        
-                        struct sockaddr_in peer_addr_check = {};
-                        socklen_t len = sizeof(peer_addr_check);
-                        if (getpeername(new_fd, (struct sockaddr*)&peer_addr_check, &len) == 0) {
-                            new_peer.addr = peer_addr_check;
-                        }
-                        
-                        peers.push_back(new_peer);
-                    }
-                } else {
-                    int peer_idx = i - 1;
-                    PeerInfo& current_peer = peers[peer_idx];
-                    int sock = current_peer.socket_fd;
-                    uint8_t msg_type;
-                    if (!recv_all(sock, &msg_type, sizeof(msg_type))) {
-                        // Disconnect logic
-                        close(sock);
-                        pfds.erase(pfds.begin() + i);
-                        peers.erase(peers.begin() + peer_idx);
-                        i--;
-                        continue;
+
+        if (pfds[0].revents & POLLIN) {
+            PeerInfo* peer = accept_peer(loop);
+            if (peer != nullptr) {
+                struct pollfd client_pfd;
+                client_pfd.fd = peer->socket_fd;
+                client_pfd.events = POLLIN;
+                client_pfd.revents = 0;
+                pfds.push_back(client_pfd);
+            }
+        }
+
+        size_t i = 1;
+        while (i < pfds.size()) {
+            if (!(pfds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) {
+                ++i;
+                continue;
+            }
+            pfds[i].revents = 0;
+
+            PeerInfo* peer = loop.conns.at(i - 1);
+            if (serve_peer(loop, *peer)) {
+                pfds[i].events = peer->tx.empty() ? POLLIN : (POLLIN | POLLOUT);
+                ++i;
+                continue;
+            }
+
+            drop_peer(loop, peer);
+            pfds[i] = pfds.back();
+            pfds.pop_back();
+            // Slot i now holds what used to be the last entry; look at it again.
+        }
+
+        expire_idle(loop, [&](PeerInfo* peer) {
+            size_t i = peer->slot + 1;
+            drop_peer(loop, peer);
+            pfds[i] = pfds.back();
+            pfds.pop_back();
+        });
+    }
+}
+
+// Edge-triggered epoll. Idle connections are never looked at: each wakeup only
+// reports the sockets that changed, and their PeerInfo comes straight out of
+// epoll_event.data.ptr. The listener is the one entry with a null pointer.
+void run_epoll(Reactor& loop) {
+    int epfd = epoll_create1(0);
+    if (epfd < 0) error_exit("epoll_create1");
+
+    set_nonblocking(loop.listen_sock);
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, loop.listen_sock, &ev) < 0) {
+        error_exit("epoll_ctl");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        count_syscalls(1);
+        int n = epoll_wait(epfd, events, MAX_EVENTS, wait_timeout_ms(loop));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error_exit("epoll_wait");
+        }
+
+        for (int e = 0; e < n; ++e) {
+            PeerInfo* peer = static_cast<PeerInfo*>(events[e].data.ptr);
+
+            if (peer == nullptr) {
+                // Edge-triggered listener: accept until the backlog is empty.
+                while ((peer = accept_peer(loop)) != nullptr) {
+                    struct epoll_event cev = {};
+                    cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    cev.data.ptr = peer;
+                    count_syscalls(1);
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, peer->socket_fd, &cev) < 0) {
+                        perror("epoll_ctl");
+                        drop_peer(loop, peer);
                     }
+                }
+                continue;
+            }
 
-                    if (msg_type == MSG_JOIN) {
-                        uint32_t id_net;
-                        if (recv_all(sock, &id_net, sizeof(id_net))) {
-                            current_peer.id = ntohl(id_net);
-                            current_peer.has_joined = true;
-                            
-                            std::cout << "TEST] JOIN " << current_peer.id << std::endl;
-                        }
+            // serve_peer reads until EAGAIN, which is what edge triggering
+            // needs; EPOLLOUT edges just retry any replies still queued.
+            if (!serve_peer(loop, *peer)) {
+                drop_peer(loop, peer);
+            }
+        }
 
-                    } else if (msg_type == MSG_PUBLISH) {
-                        uint32_t count_net;
-                        if (recv_all(sock, &count_net, sizeof(count_net))) {
-                            uint32_t count = ntohl(count_net);
-                            if (count > MAX_FILES) count = MAX_FILES;
-                            std::cout << "TEST] PUBLISH " << count;
-
-                            for (uint32_t k = 0; k < count; ++k) {
-                                char filename_buf[MAX_FILENAME_LEN] = {0}; // Init to 0
-                                if (recv_all(sock, filename_buf, sizeof(filename_buf))) {
-                                    filename_buf[MAX_FILENAME_LEN - 1] = '\0';
-                                    std::string fname(filename_buf);
-                                    current_peer.files.push_back(fname);
-                                    std::cout << " " << fname;
-                                }
-                            }
-                            std::cout << std::endl;
-                        }
+        // close() in drop_peer also takes the socket out of the epoll set.
+        expire_idle(loop, [&](PeerInfo* peer) { drop_peer(loop, peer); });
+    }
+}
 
-                    } else if (msg_type == MSG_SEARCH) {
-                        char search_buf[MAX_FILENAME_LEN] = {0};
-                        if (recv_all(sock, search_buf, sizeof(search_buf))) {
-                            search_buf[MAX_FILENAME_LEN - 1] = '\0';
-                            std::string target_file(search_buf);
-
-                            bool found = false;
-                            uint32_t found_id = 0;
-                            struct sockaddr_in found_addr = {};
-
-                            for (const auto& p : peers) {
-                                if (!p.has_joined) continue;
-                                for (const auto& f : p.files) {
-                                    if (f == target_file) {
-                                        found = true;
-                                        found_id = p.id;
-                                        found_addr = p.addr;
-                                        break;
-                                    }
-                                }
-                                if (found) break;
-                            }
-
-                            SearchResponse resp;
-                            if (found) {
-                                resp.peer_id = htonl(found_id);
-                                resp.ip_addr = found_addr.sin_addr.s_addr;
-                                resp.port    = found_addr.sin_port;
-                                
-                                std::cout << "TEST] SEARCH " << target_file << " " 
-                                          << found_id << " " 
-                                          << get_ip_str(found_addr) << ":" 
-                                          << ntohs(found_addr.sin_port) << std::endl;
-                            } else {
-                                resp.peer_id = 0;
-                                resp.ip_addr = 0;
-                                resp.port    = 0;
-
-                                std::cout << "TEST] SEARCH " << target_file << " 0 0.0.0.0:0" << std::endl;
-                            }
-
-                            send(sock, &resp, sizeof(resp), 0);
+// Completions carry the PeerInfo (null for the listener) with the operation
+// in the low bits; PeerInfo is at least 8-byte aligned.
+enum UringOp : uint64_t { URING_ACCEPT = 0, URING_RECV = 1, URING_SEND = 2 };
+const uint64_t URING_OP_MASK = 7;
+
+struct io_uring_sqe* uring_sqe(Uring& ring) {
+    struct io_uring_sqe* sqe;
+    while ((sqe = ring.get_sqe()) == nullptr) {
+        count_syscalls(1);
+        ring.submit();
+    }
+    return sqe;
+}
+
+void uring_arm_accept(Uring& ring, Reactor& loop) {
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// One multishot receive stays armed per peer; the kernel picks a provided
+// buffer for each completion.
+void uring_arm_recv(Uring& ring, PeerInfo* peer) {
+    struct io_uring_sqe* sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = peer->socket_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring.buffer_group();
+    sqe->user_data = reinterpret_cast<uint64_t>(peer) | URING_RECV;
+    peer->recv_armed = true;
+}
+
+// Queues the peer's pending replies as one chain of linked SENDs, so they
+// leave in order without a round trip through this loop between them. A
+// short send cuts the chain; the rest complete with -ECANCELED and go out
+// again in the next chain.
+void uring_send(Uring& ring, PeerInfo* peer) {
+    if (peer->sends_inflight > 0 || peer->closing) return;
+    size_t n = std::min(peer->out.size(), URING_MAX_LINKED_SENDS);
+    for (size_t i = 0; i < n; ++i) {
+        const std::string& seg = peer->out[i];
+        size_t skip = i == 0 ? peer->out_sent : 0;
+        struct io_uring_sqe* sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = peer->socket_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(seg.data() + skip);
+        sqe->len = static_cast<uint32_t>(seg.size() - skip);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < n) sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = reinterpret_cast<uint64_t>(peer) | URING_SEND;
+        ++peer->sends_inflight;
+    }
+}
+
+// Retires bytes the kernel reports sent, front segment first.
+void uring_sent(PeerInfo* peer, size_t n) {
+    while (n > 0 && !peer->out.empty()) {
+        size_t left = peer->out.front().size() - peer->out_sent;
+        if (n < left) {
+            peer->out_sent += n;
+            return;
+        }
+        n -= left;
+        peer->out.pop_front();
+        peer->out_sent = 0;
+    }
+}
+
+// Takes the peer out of the index at once; the socket and PeerInfo live on
+// until the kernel has finished every operation that refers to them.
+void uring_begin_close(PeerInfo* peer, Reactor& loop) {
+    if (peer->closing) return;
+    peer->closing = true;
+    forget_peer(loop, peer);
+    count_syscalls(1);
+    shutdown(peer->socket_fd, SHUT_RDWR);
+}
+
+void uring_maybe_free(PeerInfo* peer, Reactor& loop) {
+    if (!peer->closing || peer->recv_armed || peer->sends_inflight > 0 || peer->touched) return;
+    count_syscalls(1);
+    close(peer->socket_fd);
+    loop.conns.remove(peer);
+}
+
+// io_uring with a multishot accept, a multishot receive per peer into
+// provided buffers, and linked SENDs for the replies. Requests go through
+// the same parser and handle_frame as the other backends; everything each
+// iteration queued is submitted by the one io_uring_enter that also waits
+// for the next completions.
+void run_uring(Reactor& loop) {
+    Uring ring;
+    if (!ring.init(URING_ENTRIES)
+        || !ring.setup_buffers(URING_BUFFERS, URING_BUFFER_SIZE, 0)) {
+        perror("io_uring");
+        std::cerr << "Falling back to the epoll backend" << std::endl;
+        run_epoll(loop);
+        return;
+    }
+
+    uring_arm_accept(ring, loop);
+    std::vector<PeerInfo*> touched;
+
+    while (true) {
+        count_syscalls(1);
+        if (ring.submit_and_wait(1, wait_timeout_ms(loop)) < 0) {
+            error_exit("io_uring_enter");
+        }
+
+        ring.for_each_cqe([&](const struct io_uring_cqe& cqe) {
+            PeerInfo* peer = reinterpret_cast<PeerInfo*>(cqe.user_data & ~URING_OP_MASK);
+            uint64_t op = cqe.user_data & URING_OP_MASK;
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+
+            if (op == URING_ACCEPT) {
+                if (!more) uring_arm_accept(ring, loop);
+                if (cqe.res < 0) {
+                    errno = -cqe.res;
+                    perror("accept");
+                    return;
+                }
+                PeerInfo* added = add_peer(loop, cqe.res, sockaddr_in());
+                added->defer_send = true;
+                uring_arm_recv(ring, added);
+                return;
+            }
+
+            if (op == URING_RECV) {
+                if (!more) peer->recv_armed = false;
+                if (cqe.res > 0) {
+                    uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (!peer->closing) {
+                        uint8_t* dst = peer->rx.prepare(cqe.res);
+                        std::memcpy(dst, ring.buffer(bid), cqe.res);
+                        peer->rx.commit(cqe.res, cqe.res);
+                        peer->last_active = now_tick();
+                        dispatch_frames(loop, *peer);
+                        if (!peer->touched) {
+                            peer->touched = true;
+                            touched.push_back(peer);
                         }
-                    } else {
                     }
+                    ring.recycle(bid);
+                    if (!peer->recv_armed && !peer->closing) uring_arm_recv(ring, peer);
+                } else if (cqe.res == -ENOBUFS && !peer->closing) {
+                    // Every buffer was in use; they are back by now.
+                    if (!peer->recv_armed) uring_arm_recv(ring, peer);
+                } else {
+                    uring_begin_close(peer, loop);
                 }
+                uring_maybe_free(peer, loop);
+                return;
+            }
+
+            --peer->sends_inflight;
+            if (cqe.res >= 0) {
+                uring_sent(peer, cqe.res);
+            } else if (cqe.res != -ECANCELED) {
+                uring_begin_close(peer, loop);
+            }
+            if (peer->sends_inflight == 0 && !peer->out.empty()) uring_send(ring, peer);
+            uring_maybe_free(peer, loop);
+        });
+
+        // Replies made by this batch of completions become one send segment per peer.
+        for (PeerInfo* peer : touched) {
+            peer->touched = false;
+            if (peer->closing) {
+                uring_maybe_free(peer, loop);
+                continue;
+            }
+            if (!peer->tx.empty()) {
+                peer->out.push_back(std::move(peer->tx));
+                peer->tx.clear();
             }
+            uring_send(ring, peer);
         }
+        touched.clear();
+
+        expire_idle(loop, [&](PeerInfo* peer) {
+            uring_begin_close(peer, loop);
+            uring_maybe_free(peer, loop);
+        });
+    }
+}
+
+// Releases the restored peers that have not come back by the deadline,
+// as forget_peer does for a connection, so their holders stop being
+// handed out and are left out of the next snapshot.
+void expire_restored(Registry& reg) {
+    std::unordered_map<uint32_t, std::vector<RestoredPeer>> expired;
+    {
+        std::lock_guard<std::mutex> lock(reg.restored_mu);
+        if (reg.restored.empty() || std::chrono::steady_clock::now() < reg.restored_deadline) return;
+        expired.swap(reg.restored);
+    }
+
+    size_t peers = 0, entries = 0;
+    for (auto& same_id : expired) {
+        for (RestoredPeer& r : same_id.second) {
+            entries += r.files.size();
+            ++peers;
+            reg.index.release_all(std::move(r.files), r.key);
+        }
+    }
+    std::ostringstream msg;
+    msg << "Released " << peers << " restored peers that did not come back ("
+        << entries << " entries)\n";
+    std::cerr << msg.str();
+}
+
+// Rewrites the snapshot every interval seconds. Runs on its own thread and
+// only reads the index, under its shard locks. Restored peers past their
+// deadline are released first.
+void run_snapshots(Registry& reg, std::string path, int interval) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+        expire_restored(reg);
+        if (!write_snapshot(reg.index, path)) {
+            perror("snapshot");
+        }
+    }
+}
+
+// Loads the snapshot at path; the peers in it get grace seconds to JOIN
+// again before expire_restored drops them.
+void restore_snapshot(Registry& reg, const std::string& path, int grace) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<RestoredPeer> peers;
+    // A node added to or removed from the cluster since the snapshot was
+    // written changes ownership; names now owned elsewhere are left out and
+    // their peers re-publish them to the new owner.
+    size_t dropped = 0;
+    long entries = load_snapshot(path, reg.index, reg.next_key, peers,
+                                 [&](std::string_view name) {
+        if (reg.owns(name)) return true;
+        ++dropped;
+        return false;
+    });
+    if (entries < 0) return;
+    if (dropped > 0) {
+        std::cerr << "Skipped " << dropped << " names now owned by other cluster nodes" << std::endl;
+    }
+
+    reg.next_key += peers.size();
+    reg.restored_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(grace);
+    for (auto& r : peers) {
+        reg.restored[r.peer_id].push_back(std::move(r));
+    }
+    if (!peers.empty()) {
+        // Snapshots may be far apart; expire on time regardless.
+        std::thread([&reg, grace] {
+            std::this_thread::sleep_for(std::chrono::seconds(grace));
+            expire_restored(reg);
+        }).detach();
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Restored " << entries << " entries from " << peers.size()
+              << " peers in " << ms << " ms" << std::endl;
+}
+
+// Parses "a.b.c.d:port" into addr and its canonical string form.
+bool parse_member(const std::string& s, struct sockaddr_in& addr, std::string& canonical) {
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos) return false;
+    int port = std::atoi(s.c_str() + colon + 1);
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (port <= 0 || port > 65535
+        || inet_pton(AF_INET, s.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+    canonical = get_ip_str(addr) + ":" + std::to_string(port);
+    return true;
+}
+
+// Sets up cluster mode from a comma-separated member list. self names this
+// node's own entry. Returns false with a message on bad input.
+bool configure_cluster(Registry& reg, const std::string& list, const std::string& self) {
+    struct sockaddr_in self_addr;
+    std::string self_name;
+    if (!parse_member(self, self_addr, self_name)) {
+        std::cerr << "Bad --cluster-self address: " << self << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        struct sockaddr_in addr;
+        std::string name;
+        if (!parse_member(item, addr, name)) {
+            std::cerr << "Bad cluster member: " << item << std::endl;
+            return false;
+        }
+        if (std::find(names.begin(), names.end(), name) != names.end()) continue;
+        if (name == self_name) reg.self_node = static_cast<int>(names.size());
+        names.push_back(name);
+        reg.members.push_back(addr);
+    }
+    if (reg.self_node < 0) {
+        std::cerr << self_name << " is not in the cluster member list" << std::endl;
+        return false;
+    }
+    reg.ring.set_nodes(names);
+    return true;
+}
+
+void run_loop(Reactor& loop, const std::string& backend) {
+    if (backend == "poll") {
+        run_poll(loop);
+    } else if (backend == "io_uring") {
+        run_uring(loop);
+    } else {
+        run_epoll(loop);
     }
+}
 
-    close(listen_sock);
+int main(int argc, char* argv[]) {
+    std::string backend = "epoll";
+    int threads = 1;
+    std::string snapshot_path;
+    int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+    int idle_timeout = 0;
+    std::string cluster;
+    std::string cluster_self;
+    bool usage_ok = argc >= 2 && argc % 2 == 0;
+    for (int a = 2; usage_ok && a + 1 < argc; a += 2) {
+        std::string flag = argv[a];
+        if (flag == "--backend") {
+            backend = argv[a + 1];
+        } else if (flag == "--threads") {
+            threads = std::atoi(argv[a + 1]);
+        } else if (flag == "--snapshot") {
+            snapshot_path = argv[a + 1];
+        } else if (flag == "--snapshot-interval") {
+            snapshot_interval = std::atoi(argv[a + 1]);
+        } else if (flag == "--log-flush-ms") {
+            log_flush_ms = std::atoi(argv[a + 1]);
+        } else if (flag == "--idle-timeout") {
+            idle_timeout = std::atoi(argv[a + 1]);
+        } else if (flag == "--cluster") {
+            cluster = argv[a + 1];
+        } else if (flag == "--cluster-self") {
+            cluster_self = argv[a + 1];
+        } else {
+            usage_ok = false;
+        }
+    }
+    if (!usage_ok) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <port> [--backend epoll|poll|io_uring] [--threads N]"
+                  << " [--snapshot FILE] [--snapshot-interval SECS]"
+                  << " [--log-flush-ms MS] [--idle-timeout SECS]"
+                  << " [--cluster IP:PORT,IP:PORT,... [--cluster-self IP:PORT]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    int port = std::atoi(argv[1]);
+    if (port <= 0 || port > 65535) {
+        std::cerr << "Invalid port number." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (backend != "epoll" && backend != "poll" && backend != "io_uring") {
+        std::cerr << "Unknown backend: " << backend << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (threads < 1) {
+        std::cerr << "Invalid thread count." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (snapshot_interval < 1) {
+        std::cerr << "Invalid snapshot interval." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (log_flush_ms < 1) {
+        std::cerr << "Invalid log flush interval." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (idle_timeout < 0) {
+        std::cerr << "Invalid idle timeout." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // writev() has no MSG_NOSIGNAL; a peer that vanished must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Block before any thread starts so every thread inherits the mask.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    trace_log.start(STDOUT_FILENO, std::chrono::milliseconds(log_flush_ms));
+    std::thread(run_signal_waiter, stop_signals).detach();
+
+    Registry reg;
+    reg.idle_ticks = (uint64_t)idle_timeout * 1000 / IDLE_TICK_MS;
+    if (!cluster.empty()) {
+        if (cluster_self.empty()) cluster_self = "127.0.0.1:" + std::to_string(port);
+        if (!configure_cluster(reg, cluster, cluster_self)) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (!snapshot_path.empty()) {
+        restore_snapshot(reg, snapshot_path, idle_timeout > 0 ? idle_timeout : DEFAULT_RESTORE_GRACE);
+        std::thread(run_snapshots, std::ref(reg), snapshot_path, snapshot_interval).detach();
+    }
+
+    std::vector<std::unique_ptr<Reactor>> loops;
+    for (int t = 0; t < threads; ++t) {
+        loops.emplace_back(new Reactor(reg));
+        loops.back()->listen_sock = open_listener(port, threads > 1);
+    }
+
+    // The main thread runs the first loop itself.
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        workers.emplace_back(run_loop, std::ref(*loops[t]), backend);
+    }
+    run_loop(*loops[0], backend);
+
+    for (auto& w : workers) {
+        w.join();
+    }
+    for (auto& loop : loops) {
+        close(loop->listen_sock);
+    }
+    trace_log.stop();
     return 0;
-}
\ No newline at end of file
+}
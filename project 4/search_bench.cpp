@@ -0,0 +1,173 @@
+/*
+ * search_bench.cpp
+ *
+ * Compares the registry's old SEARCH (walk every peer, then every file of
+ * that peer) against the FileIndex hash probe at 1k, 10k and 100k peers.
+ * Every peer publishes MAX_FILES names; a third of the queries miss.
+ * After that, SEARCH_PATTERN prefix and substring queries are timed against
+ * the same index (1M distinct names at 100k peers).
+ *
+ * Usage: ./search_bench
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <cstdint>
+#include <arpa/inet.h>
+
+#include "file_index.h"
+
+const int MAX_FILES = 10;
+
+struct BenchPeer {
+    uint64_t key;
+    uint32_t id;
+    struct sockaddr_in addr;
+    std::vector<std::string> files;
+    bool has_joined;
+};
+
+// The SEARCH loop as it was before the index existed.
+const BenchPeer* linear_search(const std::vector<BenchPeer>& peers, const std::string& target) {
+    for (const auto& p : peers) {
+        if (!p.has_joined) continue;
+        for (const auto& f : p.files) {
+            if (f == target) return &p;
+        }
+    }
+    return nullptr;
+}
+
+std::string file_name(size_t peer, int k) {
+    return "peer" + std::to_string(peer) + "_file" + std::to_string(k) + ".dat";
+}
+
+template <typename F>
+double ns_per_op(size_t ops, F&& body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+// Each run's index is kept for the pattern section.
+std::vector<std::unique_ptr<FileIndex>> patterns;
+
+void run(size_t num_peers) {
+    std::vector<BenchPeer> peers(num_peers);
+    std::unique_ptr<FileIndex> index_ptr(new FileIndex());
+    FileIndex& index = *index_ptr;
+
+    for (size_t i = 0; i < num_peers; ++i) {
+        BenchPeer& p = peers[i];
+        p.key = i + 1;
+        p.id = static_cast<uint32_t>(i + 1);
+        p.addr = {};
+        p.addr.sin_family = AF_INET;
+        p.addr.sin_addr.s_addr = htonl(0x7f000001);
+        p.addr.sin_port = htons(static_cast<uint16_t>(20000 + i % 40000));
+        p.has_joined = true;
+        for (int k = 0; k < MAX_FILES; ++k) {
+            p.files.push_back(file_name(i, k));
+            index.add(index.intern(p.files.back()), Holder{p.key, p.id, p.addr});
+        }
+    }
+
+    // Same query mix for both: two hits for every miss, spread over all peers.
+    std::mt19937 rng(446);
+    std::uniform_int_distribution<size_t> pick_peer(0, num_peers - 1);
+    std::uniform_int_distribution<int> pick_file(0, MAX_FILES - 1);
+    std::vector<std::string> queries;
+    for (int q = 0; q < 3000; ++q) {
+        if (q % 3 == 2) {
+            queries.push_back("missing" + std::to_string(q) + ".dat");
+        } else {
+            queries.push_back(file_name(pick_peer(rng), pick_file(rng)));
+        }
+    }
+
+    // The linear scan gets fewer queries at larger sizes so the run stays short.
+    size_t linear_ops = std::max<size_t>(30, queries.size() * 1000 / num_peers);
+    if (linear_ops > queries.size()) linear_ops = queries.size();
+    size_t linear_hits = 0;
+    double linear_ns = ns_per_op(linear_ops, [&] {
+        for (size_t q = 0; q < linear_ops; ++q) {
+            if (linear_search(peers, queries[q]) != nullptr) ++linear_hits;
+        }
+    });
+
+    const size_t index_rounds = 100;
+    size_t index_hits = 0;
+    Holder h;
+    double index_ns = ns_per_op(index_rounds * queries.size(), [&] {
+        for (size_t r = 0; r < index_rounds; ++r) {
+            for (const auto& q : queries) {
+                if (index.find_first(q, h)) ++index_hits;
+            }
+        }
+    });
+
+    // Both must agree on who answers, or the comparison is meaningless.
+    for (size_t q = 0; q < linear_ops; ++q) {
+        const BenchPeer* a = linear_search(peers, queries[q]);
+        bool b = index.find_first(queries[q], h);
+        if ((a != nullptr) != b || (a != nullptr && a->key != h.key)) {
+            std::cerr << "Mismatch on query " << queries[q] << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    std::cout << std::setw(8) << num_peers
+              << std::setw(16) << std::fixed << std::setprecision(0) << linear_ns
+              << std::setw(14) << std::setprecision(1) << index_ns
+              << std::setw(12) << std::setprecision(0) << linear_ns / index_ns << "x"
+              << "   (hits " << linear_hits << "/" << linear_ops
+              << ", " << index_hits / index_rounds << "/" << queries.size() << ")"
+              << std::endl;
+
+    patterns.push_back(std::move(index_ptr));
+}
+
+// Microseconds per find_pattern() call, limit 50, cycling through patterns.
+void time_patterns(const FileIndex& index, bool prefix, const std::vector<std::string>& pats) {
+    const size_t rounds = 200;
+    size_t matched = 0;
+    // Untimed first pass: the first allocation after freeing the big peer
+    // table makes malloc consolidate its free lists, which is not our cost.
+    for (const auto& p : pats) index.find_pattern(prefix, p, 50);
+    double ns = ns_per_op(rounds * pats.size(), [&] {
+        for (size_t r = 0; r < rounds; ++r) {
+            for (const auto& p : pats) {
+                matched += index.find_pattern(prefix, p, 50).size();
+            }
+        }
+    });
+    std::cout << std::setw(10) << (prefix ? "prefix" : "substring")
+              << std::setw(12) << std::setprecision(1) << ns / 1000.0 << " us/op"
+              << "   (avg " << matched / (rounds * pats.size()) << " matches)" << std::endl;
+}
+
+int main() {
+    std::cout << std::setw(8) << "peers"
+              << std::setw(16) << "linear ns/op"
+              << std::setw(14) << "index ns/op"
+              << std::setw(13) << "speedup" << std::endl;
+
+    for (size_t n : {1000, 10000, 100000}) {
+        run(n);
+    }
+
+    // Broad and narrow patterns: many matches (limit reached) and few or none.
+    const FileIndex& big = *patterns.back();
+    std::cout << std::endl << "SEARCH_PATTERN over " << big.size() << " names" << std::endl;
+    time_patterns(big, true, {"peer1", "peer4242", "peer99999_file9", "nomatch"});
+    time_patterns(big, false, {"_file3.", "er4242_", "99999_file9", "zzz"});
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * snapshot.h
+ *
+ * Saves the registry's index to disk and rebuilds it on startup, so a
+ * restarted registry still answers SEARCH for everyone who had published
+ * and returning peers only need to JOIN again.
+ *
+ * File layout (native byte order; ip and port as stored in sockaddr_in):
+ *
+ *   SnapshotHeader
+ *   holder_count x { peer_id(4) ip(4) port(2) pad(2) }
+ *   name_count   x { len(2) holders(4) name[len] holder_index(4) x holders }
+ *
+ * The writer produces path + ".tmp" and renames it over path, so a reader
+ * never sees a half-written file. The loader mmaps the file and walks it in
+ * place.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_index.h"
+
+const char SNAPSHOT_MAGIC[4] = {'P', '4', 'R', 'S'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t holder_count;
+    uint32_t name_count;
+    uint64_t entry_count;
+    uint64_t file_size;         // lets the loader reject truncated files
+};
+
+// A peer from the last snapshot whose connection has not come back yet.
+// Its names stay indexed under key until a JOIN with the same id and IP
+// adopts them, or the registry stops waiting for it.
+struct RestoredPeer {
+    uint64_t key;
+    uint32_t peer_id;
+    struct sockaddr_in addr;
+    std::vector<NameId> files;
+};
+
+inline void put_bytes(std::vector<uint8_t>& out, const void* p, size_t len) {
+    const uint8_t* b = static_cast<const uint8_t*>(p);
+    out.insert(out.end(), b, b + len);
+}
+
+// Returns false (with errno set) if the file could not be written.
+inline bool write_snapshot(const FileIndex& index, const std::string& path) {
+    std::vector<uint8_t> holders;
+    std::vector<uint8_t> names;
+    std::unordered_map<uint64_t, uint32_t> holder_slot;
+    uint32_t name_count = 0;
+    uint64_t entry_count = 0;
+
+    index.for_each_name([&](std::string_view name, const std::vector<Holder>& hs) {
+        uint16_t len = static_cast<uint16_t>(name.size());
+        uint32_t n = static_cast<uint32_t>(hs.size());
+        put_bytes(names, &len, sizeof(len));
+        put_bytes(names, &n, sizeof(n));
+        put_bytes(names, name.data(), len);
+
+        for (const Holder& h : hs) {
+            auto ins = holder_slot.emplace(h.key, static_cast<uint32_t>(holder_slot.size()));
+            if (ins.second) {
+                uint16_t pad = 0;
+                put_bytes(holders, &h.peer_id, 4);
+                put_bytes(holders, &h.addr.sin_addr.s_addr, 4);
+                put_bytes(holders, &h.addr.sin_port, 2);
+                put_bytes(holders, &pad, 2);
+            }
+            put_bytes(names, &ins.first->second, 4);
+        }
+        ++name_count;
+        entry_count += n;
+    });
+
+    SnapshotHeader hdr;
+    std::memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.holder_count = static_cast<uint32_t>(holder_slot.size());
+    hdr.name_count = name_count;
+    hdr.entry_count = entry_count;
+    hdr.file_size = sizeof(hdr) + holders.size() + names.size();
+
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (fp == nullptr) return false;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+           && fwrite(holders.data(), 1, holders.size(), fp) == holders.size()
+           && fwrite(names.data(), 1, names.size(), fp) == names.size()
+           && fflush(fp) == 0
+           && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0) ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Rebuilds index from the snapshot at path. Restored holders get the keys
+// first_key, first_key + 1, ...; their records are appended to restored.
+// Names for which keep returns false are skipped. Returns the number of
+// index entries loaded, or -1 if there is no usable snapshot (missing,
+// truncated, or another version).
+inline long load_snapshot(const std::string& path, FileIndex& index, uint64_t first_key,
+                          std::vector<RestoredPeer>& restored,
+                          const std::function<bool(std::string_view)>& keep = nullptr) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const uint8_t* base = static_cast<const uint8_t*>(map);
+    const uint8_t* end = base + size;
+    SnapshotHeader hdr;
+    std::memcpy(&hdr, base, sizeof(hdr));
+
+    long loaded = -1;
+    const uint8_t* p = base + sizeof(hdr);
+    size_t holder_bytes = (size_t)hdr.holder_count * 12;
+    if (std::memcmp(hdr.magic, SNAPSHOT_MAGIC, 4) == 0 && hdr.version == SNAPSHOT_VERSION
+        && hdr.file_size == size && holder_bytes <= (size_t)(end - p)) {
+
+        size_t first = restored.size();
+        for (uint32_t i = 0; i < hdr.holder_count; ++i, p += 12) {
+            RestoredPeer r;
+            r.key = first_key + i;
+            std::memcpy(&r.peer_id, p, 4);
+            r.addr = {};
+            r.addr.sin_family = AF_INET;
+            std::memcpy(&r.addr.sin_addr.s_addr, p + 4, 4);
+            std::memcpy(&r.addr.sin_port, p + 8, 2);
+            restored.push_back(r);
+        }
+
+        bool ok = true;
+        for (uint32_t i = 0; ok && i < hdr.name_count; ++i) {
+            uint16_t len;
+            uint32_t n;
+            if (end - p < 6) { ok = false; break; }
+            std::memcpy(&len, p, 2);
+            std::memcpy(&n, p + 2, 4);
+            p += 6;
+            if ((size_t)(end - p) < len + (size_t)n * 4) { ok = false; break; }
+            std::string_view name(reinterpret_cast<const char*>(p), len);
+            p += len;
+            if (n == 0) continue;
+            if (keep && !keep(name)) {
+                if ((size_t)(end - p) < (size_t)n * 4) { ok = false; break; }
+                p += (size_t)n * 4;
+                continue;
+            }
+
+            // One reference per restored holder, released when each goes away.
+            NameId id = index.intern(name, n);
+            for (uint32_t k = 0; k < n; ++k, p += 4) {
+                uint32_t slot;
+                std::memcpy(&slot, p, 4);
+                if (slot >= hdr.holder_count) { ok = false; break; }
+                RestoredPeer& r = restored[first + slot];
+                r.files.push_back(id);
+                index.add(id, Holder{r.key, r.peer_id, r.addr});
+            }
+        }
+        // A corrupt tail keeps whatever was read before it; that is still
+        // better than starting empty.
+        loaded = static_cast<long>(index.size());
+    }
+
+    munmap(map, size);
+    return loaded;
+}
+
+#endif
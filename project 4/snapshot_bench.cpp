@@ -0,0 +1,67 @@
+/*
+ * snapshot_bench.cpp
+ *
+ * Times writing and reloading a registry snapshot holding a million index
+ * entries: 100k peers publishing MAX_FILES names each, half of them shared.
+ *
+ * Usage: ./snapshot_bench [snapshot file]
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <cstdlib>
+#include <arpa/inet.h>
+
+#include "file_index.h"
+#include "snapshot.h"
+
+const int MAX_FILES = 10;
+const size_t PEERS = 100000;
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "snapshot_bench.bin";
+
+    std::unique_ptr<FileIndex> index(new FileIndex());
+    for (size_t i = 0; i < PEERS; ++i) {
+        Holder h;
+        h.key = i + 1;
+        h.peer_id = static_cast<uint32_t>(i + 1);
+        h.addr = {};
+        h.addr.sin_family = AF_INET;
+        h.addr.sin_addr.s_addr = htonl(0x0a000000 + static_cast<uint32_t>(i));
+        h.addr.sin_port = htons(static_cast<uint16_t>(20000 + i % 40000));
+        for (int k = 0; k < MAX_FILES; ++k) {
+            std::string name = k % 2 == 0
+                ? "popular_" + std::to_string((i + k) % 5000) + ".iso"
+                : "peer" + std::to_string(i) + "_file" + std::to_string(k) + ".dat";
+            index->add(index->intern(name), h);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (!write_snapshot(*index, path)) {
+        perror("write_snapshot");
+        return EXIT_FAILURE;
+    }
+    double write_ms = ms_since(start);
+
+    std::unique_ptr<FileIndex> restored(new FileIndex());
+    std::vector<RestoredPeer> peers;
+    start = std::chrono::steady_clock::now();
+    long entries = load_snapshot(path, *restored, 1, peers);
+    double load_ms = ms_since(start);
+
+    std::cout << "entries " << index->size() << ", restored " << entries
+              << " from " << peers.size() << " peers" << std::endl;
+    std::cout << "write " << write_ms << " ms, load " << load_ms << " ms" << std::endl;
+
+    unlink(path.c_str());
+    return entries == static_cast<long>(index->size()) ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,151 @@
+/*
+ * timer_wheel.h
+ *
+ * Hierarchical timing wheel for the registry's idle-peer eviction.
+ *
+ * Time is counted in ticks. Level 0 has 256 slots of one tick each; levels
+ * 1..3 have 64 slots, each covering 64 times the span of a slot one level
+ * down. A timer goes into the coarsest level that still separates it from
+ * the present and is moved down ("cascaded") when the lower level wraps
+ * around to its slot, so schedule, cancel and each tick are O(1) no matter
+ * how many timers are pending. Timers further out than the top level can
+ * reach are parked in its last slot and re-filed when they come round.
+ *
+ * Nodes are intrusive: the owner embeds a TimerNode and gets it back in the
+ * expiry callback, so the wheel never allocates.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;      // null while not scheduled
+    uint64_t expires = 0;           // tick
+    void* owner = nullptr;
+
+    bool pending() const { return next != nullptr; }
+};
+
+class TimerWheel {
+public:
+    explicit TimerWheel(uint64_t start_tick = 0) : next_tick(start_tick) {
+        for (size_t l = 0; l < LEVELS; ++l) {
+            for (size_t s = 0; s < SLOTS0; ++s) {
+                slots[l][s].prev = slots[l][s].next = &slots[l][s];
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // (Re)arms n to fire at tick expires, or on the next tick if that has passed.
+    void schedule(TimerNode* n, uint64_t expires) {
+        if (n->pending()) unlink(n);
+        n->expires = expires;
+        file(n);
+        ++count;
+    }
+
+    void cancel(TimerNode* n) {
+        if (!n->pending()) return;
+        unlink(n);
+        --count;
+    }
+
+    // Runs every tick up to and including now, calling fire(node) for each
+    // timer that expires. fire may schedule or cancel any timer.
+    template <typename F>
+    void advance(uint64_t now, F fire) {
+        while (next_tick <= now) {
+            uint64_t t = next_tick;
+            if ((t & (SLOTS0 - 1)) == 0) {
+                for (size_t l = 1; l < LEVELS; ++l) {
+                    size_t idx = (t >> (BITS0 + (l - 1) * BITS)) & (SLOTS - 1);
+                    cascade(slots[l][idx]);
+                    if (idx != 0) break;
+                }
+            }
+
+            TimerNode& head = slots[0][t & (SLOTS0 - 1)];
+            ++next_tick;
+            while (head.next != &head) {
+                TimerNode* n = head.next;
+                unlink(n);
+                --count;
+                fire(n);
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+
+private:
+    static const int BITS0 = 8;
+    static const int BITS = 6;
+    static const size_t SLOTS0 = size_t(1) << BITS0;
+    static const size_t SLOTS = size_t(1) << BITS;
+    static const size_t LEVELS = 4;
+    static const uint64_t SPAN = uint64_t(1) << (BITS0 + (LEVELS - 1) * BITS);
+
+    static void unlink(TimerNode* n) {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+        n->prev = n->next = nullptr;
+    }
+
+    static void push(TimerNode& head, TimerNode* n) {
+        n->prev = head.prev;
+        n->next = &head;
+        head.prev->next = n;
+        head.prev = n;
+    }
+
+    void file(TimerNode* n) {
+        uint64_t when = n->expires < next_tick ? next_tick : n->expires;
+        if (when - next_tick >= SPAN) when = next_tick + SPAN - 1;
+        uint64_t diff = when - next_tick;
+
+        if (diff < SLOTS0) {
+            push(slots[0][when & (SLOTS0 - 1)], n);
+            return;
+        }
+        for (size_t l = 1; l < LEVELS; ++l) {
+            int shift = BITS0 + l * BITS;
+            if (diff < (uint64_t(1) << shift) || l == LEVELS - 1) {
+                push(slots[l][(when >> (shift - BITS)) & (SLOTS - 1)], n);
+                return;
+            }
+        }
+    }
+
+    // Re-files every timer in a higher-level slot against the current tick.
+    // The slot is emptied first: a parked timer may be filed straight back
+    // into it.
+    void cascade(TimerNode& head) {
+        if (head.next == &head) return;
+        TimerNode moving;
+        moving.next = head.next;
+        moving.prev = head.prev;
+        moving.next->prev = &moving;
+        moving.prev->next = &moving;
+        head.next = head.prev = &head;
+
+        while (moving.next != &moving) {
+            TimerNode* n = moving.next;
+            unlink(n);
+            file(n);
+        }
+    }
+
+    // Level 0 uses all SLOTS0 entries; higher levels only the first SLOTS.
+    TimerNode slots[LEVELS][SLOTS0];
+    uint64_t next_tick;
+    size_t count = 0;
+};
+
+#endif
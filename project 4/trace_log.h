@@ -0,0 +1,140 @@
+/*
+ * trace_log.h
+ *
+ * Asynchronous writer for the registry's "TEST]" trace lines. Event loops
+ * push finished lines into a bounded lock-free ring (Vyukov's MPMC queue,
+ * used here with any number of producers and one consumer) and return at
+ * once; a background thread wakes every flush interval, drains the ring and
+ * hands the whole batch to a single write().
+ *
+ * Lines are written exactly as pushed, plus a newline, in the order their
+ * push completed. A producer that finds the ring full yields until the
+ * writer catches up rather than dropping the line.
+ */
+
+#ifndef TRACE_LOG_H
+#define TRACE_LOG_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+
+class TraceLog {
+public:
+    // capacity is rounded up to a power of two.
+    explicit TraceLog(size_t capacity = 65536) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (size_t i = 0; i < n; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~TraceLog() { stop(); }
+
+    void start(int out_fd, std::chrono::milliseconds interval) {
+        fd = out_fd;
+        flush_interval = interval;
+        running.store(true, std::memory_order_release);
+        writer = std::thread(&TraceLog::run, this);
+    }
+
+    // Drains whatever is queued and stops the writer thread.
+    void stop() {
+        if (!writer.joinable()) return;
+        running.store(false, std::memory_order_release);
+        writer.join();
+    }
+
+    void push(std::string line) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.line = std::move(line);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return;
+                }
+            } else if (diff < 0) {
+                // Full: wait for the writer to free a cell.
+                std::this_thread::yield();
+                pos = head.load(std::memory_order_relaxed);
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    static const size_t BATCH_BYTES = 64 * 1024;
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        std::string line;
+    };
+
+    // Only the writer thread pops, so tail needs no atomics.
+    bool pop(std::string& batch) {
+        Cell& c = cells[tail & mask];
+        if (c.seq.load(std::memory_order_acquire) != tail + 1) return false;
+        batch += c.line;
+        batch += '\n';
+        c.line.clear();
+        c.seq.store(tail + mask + 1, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+
+    void drain(std::string& batch) {
+        while (pop(batch)) {
+            if (batch.size() >= BATCH_BYTES) write_all(batch);
+        }
+        write_all(batch);
+    }
+
+    void write_all(std::string& batch) {
+        size_t off = 0;
+        while (off < batch.size()) {
+            ssize_t n = write(fd, batch.data() + off, batch.size() - off);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;      // nowhere to report it; drop the batch
+            }
+            off += n;
+        }
+        batch.clear();
+    }
+
+    void run() {
+        std::string batch;
+        batch.reserve(BATCH_BYTES);
+        while (running.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(flush_interval);
+            drain(batch);
+        }
+        drain(batch);
+    }
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) size_t tail = 0;
+
+    int fd = STDOUT_FILENO;
+    std::chrono::milliseconds flush_interval{10};
+    std::atomic<bool> running{false};
+    std::thread writer;
+};
+
+#endif
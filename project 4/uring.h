@@ -0,0 +1,208 @@
+/*
+ * uring.h
+ *
+ * Just enough of io_uring for the registry's --backend io_uring, on the raw
+ * system calls (no liburing): ring setup and mmap, SQE allocation, one
+ * io_uring_enter per loop iteration to submit and wait, CQE iteration, and
+ * a registered ring of provided receive buffers.
+ *
+ * Head and tail indexes shared with the kernel are read with acquire and
+ * published with release ordering, as the io_uring ABI requires.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+class Uring {
+public:
+    Uring() = default;
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    ~Uring() {
+        if (buf_ring != nullptr) munmap(buf_ring, buf_ring_bytes);
+        free(buf_base);
+        if (sqes != nullptr) munmap(sqes, sqes_bytes);
+        if (cq_ptr != nullptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_bytes);
+        if (sq_ptr != nullptr) munmap(sq_ptr, sq_bytes);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    // Returns false with errno set if the kernel has no usable io_uring.
+    bool init(unsigned entries) {
+        struct io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SUBMIT_ALL;
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (ring_fd < 0) return false;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+            errno = ENOSYS;
+            return false;
+        }
+
+        sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (cq_bytes > sq_bytes) sq_bytes = cq_bytes;
+        sq_ptr = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            return false;
+        }
+        cq_ptr = sq_ptr;
+
+        sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+        void* s = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return false;
+        sqes = static_cast<struct io_uring_sqe*>(s);
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        local_tail = *sq_tail;
+        return true;
+    }
+
+    // A zeroed SQE, or nullptr if the submission queue is full; submit() and
+    // try again.
+    struct io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries) return nullptr;
+        unsigned idx = local_tail & sq_mask;
+        struct io_uring_sqe* sqe = &sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        ++local_tail;
+        return sqe;
+    }
+
+    // Submits everything queued and waits for at least wait_nr completions,
+    // or until timeout_ms passes (-1 waits indefinitely). One system call.
+    int submit_and_wait(unsigned wait_nr, int timeout_ms) {
+        unsigned to_submit = local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        std::memset(&arg, 0, sizeof(arg));
+        void* argp = nullptr;
+        size_t argsz = 0;
+        if (wait_nr > 0 && timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof(arg);
+        }
+        int r = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                                         flags, argp, argsz));
+        if (r < 0 && (errno == ETIME || errno == EINTR)) return 0;
+        return r;
+    }
+
+    int submit() { return submit_and_wait(0, -1); }
+
+    // Calls f(cqe) for every completion posted so far and retires them.
+    template <typename F>
+    void for_each_cqe(F f) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            f(cqes[head & cq_mask]);
+            ++head;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Registers count buffers of size bytes each as buffer group bgid.
+    bool setup_buffers(unsigned count, unsigned size, uint16_t bgid) {
+        buf_count = count;
+        buf_size = size;
+        group = bgid;
+        buf_ring_bytes = count * sizeof(struct io_uring_buf);
+        void* r = mmap(nullptr, buf_ring_bytes, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (r == MAP_FAILED) return false;
+        buf_ring = static_cast<struct io_uring_buf*>(r);
+        buf_base = static_cast<uint8_t*>(malloc((size_t)count * size));
+        if (buf_base == nullptr) return false;
+
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = count;
+        reg.bgid = bgid;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
+        for (unsigned b = 0; b < count; ++b) recycle(static_cast<uint16_t>(b));
+        return true;
+    }
+
+    const uint8_t* buffer(uint16_t bid) const { return buf_base + (size_t)bid * buf_size; }
+
+    // Hands a provided buffer back to the kernel once its data has been copied.
+    void recycle(uint16_t bid) {
+        struct io_uring_buf& b = buf_ring[buf_tail & (buf_count - 1)];
+        b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+        b.len = buf_size;
+        b.bid = bid;
+        ++buf_tail;
+        // The ring tail lives in the resv field of the first entry.
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    uint16_t buffer_group() const { return group; }
+    unsigned buffer_size() const { return buf_size; }
+
+private:
+    int ring_fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_bytes = 0, cq_bytes = 0, sqes_bytes = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned local_tail = 0;
+    struct io_uring_sqe* sqes = nullptr;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+
+    struct io_uring_buf* buf_ring = nullptr;
+    size_t buf_ring_bytes = 0;
+    uint8_t* buf_base = nullptr;
+    unsigned buf_count = 0, buf_size = 0;
+    uint16_t buf_tail = 0;
+    uint16_t group = 0;
+};
+
+#endif